@@ -60,6 +60,10 @@ type  q_val =
   | Q_v_minute of int32_bigarray * attrib
   | Q_v_second of int32_bigarray * attrib
   | Q_v_time of int32_bigarray * attrib
+  (* lists of strings (q general lists of char vectors), stored as one
+     contiguous char buffer plus n+1 offsets: string i is
+     chars.{offsets.{i}} .. chars.{offsets.{i+1} - 1} *)
+  | Q_v_string of char_bigarray * int64_bigarray * attrib
   (* mixed lists *)
   | Q_mixed_list of q_val array
   (* tables *)
@@ -79,10 +83,14 @@ type q_conn = int32
 
 external q_connect_ : string -> int -> q_conn = "q_connect"
 
+external q_connect_unix : int -> q_conn = "q_connect_unix"
+
 exception Q_connect of string
 
 let q_connect host port =
-  match q_connect_ host port with
+  let q_conn =
+    if host = "unix://" then q_connect_unix port else q_connect_ host port in
+  match q_conn with
   | (-1l) -> 
       let msg = host ^ ":" ^ (string_of_int port) ^  " host unknown or connection refused on port" in
       raise (Q_connect msg)
@@ -97,5 +105,198 @@ external q_rpc_async : q_conn -> string -> q_val -> unit = "q_rpc_async"
 
 external q_rpc : q_conn -> string -> q_val -> q_val = "q_rpc"
 
+external q_close : q_conn -> unit = "q_close"
+
+type q_shard_status =
+  | Shard_ok
+  | Shard_error of string
+  | Shard_timeout
+
+external q_fanout : q_conn array -> float array -> string -> q_val array * q_shard_status array = "q_fanout"
+
+external q_fanout_merge_ : q_conn array -> float array -> string -> string -> q_val * q_shard_status array = "q_fanout_merge"
+
+let q_fanout_merge ?(sort_col = "") q_conns timeouts query =
+  q_fanout_merge_ q_conns timeouts query sort_col
+
+external q_merge_tables_ : q_val array -> string -> q_val = "q_merge_tables"
+
+let q_merge_tables ?(sort_col = "") tables = q_merge_tables_ tables sort_col
+
+
+external q_arrow_export : q_val -> nativeint -> nativeint -> unit = "q_arrow_export"
+
+external q_arrow_alloc : unit -> nativeint * nativeint = "q_arrow_alloc"
+
+external q_arrow_free : nativeint * nativeint -> unit = "q_arrow_free"
+
+
+type q_k (* a K value, freed by the finaliser *)
+
+type q_view_child =
+  | V_index of int
+  | V_column of string
+  | V_key of string
+  | V_keys
+  | V_values
+
+type q_view = { view_k: q_k;
+                mutable view_val: q_val option;
+                mutable view_children: (q_view_child, q_view) Hashtbl.t option }
+
+external q_eval_view_ : q_conn -> string -> q_k = "q_eval_view"
+external q_rpc_view_ : q_conn -> string -> q_val -> q_k = "q_rpc_view"
+external q_view_of_val_ : q_val -> q_k = "q_view_of_val"
+external q_view_type_ : q_k -> int = "q_view_type"
+external q_view_count_ : q_k -> int = "q_view_count"
+external q_view_index_ : q_k -> int -> q_k = "q_view_index"
+external q_view_column_ : q_k -> string -> q_k = "q_view_column"
+external q_view_find_ : q_k -> string -> q_k = "q_view_find"
+external q_view_keys_ : q_k -> q_k = "q_view_keys"
+external q_view_values_ : q_k -> q_k = "q_view_values"
+external q_view_to_caml : q_k -> q_val = "q_view_to_caml"
+
+let mk_view k = { view_k = k; view_val = None; view_children = None }
+
+let q_eval_view q_conn str = mk_view (q_eval_view_ q_conn str)
+
+let q_rpc_view q_conn str v = mk_view (q_rpc_view_ q_conn str v)
+
+let q_view_of_val v = mk_view (q_view_of_val_ v)
+
+let q_view_type view = q_view_type_ view.view_k
+
+let q_view_count view = q_view_count_ view.view_k
+
+let child view key get =
+  let children =
+    match view.view_children with
+    | Some children -> children
+    | None ->
+        let children = Hashtbl.create 8 in
+        view.view_children <- Some children;
+        children in
+  try Hashtbl.find children key
+  with Not_found ->
+    let c = mk_view (get view.view_k) in
+    Hashtbl.add children key c;
+    c
+
+let q_view_index view i = child view (V_index i) (fun k -> q_view_index_ k i)
+
+let q_view_column view name = child view (V_column name) (fun k -> q_view_column_ k name)
+
+let q_view_find view key = child view (V_key key) (fun k -> q_view_find_ k key)
+
+let q_view_keys view = child view V_keys q_view_keys_
+
+let q_view_values view = child view V_values q_view_values_
+
+let q_view_value view =
+  match view.view_val with
+  | Some v -> v
+  | None ->
+      let v = q_view_to_caml view.view_k in
+      view.view_val <- Some v;
+      v
+
+
+type q_journal
+
+external q_journal_open : string -> q_journal = "q_journal_open"
+
+external q_journal_validate : q_journal -> int * bool = "q_journal_validate"
+
+external q_journal_replay_ : q_journal -> int -> int -> string array -> (string -> q_val -> unit) -> (int -> string -> unit) -> int = "q_journal_replay_bytecode" "q_journal_replay"
+
+let report_message_error index reason =
+  prerr_endline ("q_journal_replay: message " ^ string_of_int index ^ ": " ^ reason)
+
+let q_journal_replay ?(first = 0) ?(last = -1) ?(tables = []) ?(on_error = report_message_error) journal f =
+  q_journal_replay_ journal first last (Array.of_list tables) f on_error
+
+
+external q_serialize : q_val -> string = "q_serialize"
+
+external q_deserialize : string -> q_val = "q_deserialize"
+
+external q_write_file : string -> q_val -> unit = "q_write_file"
+
+type q_mapped_file
+
+external q_map_value_file : string -> q_mapped_file = "q_map_value_file"
+
+external q_mapped_value_ : q_mapped_file -> bool -> q_val = "q_mapped_value"
+
+let q_mapped_value mapped = q_mapped_value_ mapped true
+
+let q_mapped_value_unsafe mapped = q_mapped_value_ mapped false
+
+let q_read_file path = q_mapped_value (q_map_value_file path)
+
+
+type q_result =
+  | Q_ok of q_val
+  | Q_error of string
+
+external q_eval_batch : q_conn -> string array -> q_result array = "q_eval_batch"
+
+external q_rpc_batch : q_conn -> (string * q_val) array -> q_result array = "q_rpc_batch"
+
+
+exception Q_timeout of string
+
+let () = Callback.register_exception "Q_timeout" (Q_timeout "")
+
+external q_connect_timeout_ : string -> int -> float -> q_conn = "q_connect_timeout"
+
+let q_connect_timeout host port timeout =
+  let where = host ^ ":" ^ (string_of_int port) in
+  match q_connect_timeout_ host port timeout with
+  | (-1l) -> raise (Q_connect (where ^ " host unknown or connection refused on port"))
+  | (-2l) -> raise (Q_timeout (where ^ " connection timed out"))
+  | q_conn -> q_conn
+
+type q_slo = { slo_target: float;
+               mutable slo_calls: int;
+               mutable slo_over_target: int;
+               mutable slo_timeouts: int;
+               mutable slo_errors: int;
+               mutable slo_total_time: float;
+               mutable slo_max_time: float }
+
+let q_slo_create target =
+  { slo_target = target; slo_calls = 0; slo_over_target = 0; slo_timeouts = 0;
+    slo_errors = 0; slo_total_time = 0.; slo_max_time = 0. }
+
+external q_clock : unit -> float = "q_clock"
+
+let measured slo f =
+  match slo with
+  | None -> f ()
+  | Some slo ->
+      let start = q_clock () in
+      let record () =
+        let t = q_clock () -. start in
+        slo.slo_calls <- slo.slo_calls + 1;
+        if t > slo.slo_target then slo.slo_over_target <- slo.slo_over_target + 1;
+        slo.slo_total_time <- slo.slo_total_time +. t;
+        if t > slo.slo_max_time then slo.slo_max_time <- t in
+      try
+        let v = f () in
+        record ();
+        v
+      with
+      | Q_timeout _ as e -> slo.slo_timeouts <- slo.slo_timeouts + 1; record (); raise e
+      | e -> slo.slo_errors <- slo.slo_errors + 1; record (); raise e
+
+external q_eval_timeout_ : q_conn -> float -> string -> q_val = "q_eval_timeout"
+
+external q_rpc_timeout_ : q_conn -> float -> string -> q_val -> q_val = "q_rpc_timeout"
+
+let q_eval_timeout ?slo q_conn timeout str =
+  measured slo (fun () -> q_eval_timeout_ q_conn timeout str)
 
+let q_rpc_timeout ?slo q_conn timeout str v =
+  measured slo (fun () -> q_rpc_timeout_ q_conn timeout str v)
 
@@ -62,6 +62,10 @@ type  q_val =
   | Q_v_minute of int32_bigarray * attrib
   | Q_v_second of int32_bigarray * attrib
   | Q_v_time of int32_bigarray * attrib
+  (* lists of strings (q general lists of char vectors), stored as one
+     contiguous char buffer plus n+1 offsets: string i is
+     chars.{offsets.{i}} .. chars.{offsets.{i+1} - 1} *)
+  | Q_v_string of char_bigarray * int64_bigarray * attrib
   (* mixed lists *)
   | Q_mixed_list of q_val array
   (* tables and dictionaries *)
@@ -86,6 +90,9 @@ type q_conn (* abstract *)
 
 exception Q_connect of string
 
+(* q_connect host port connects over TCP. q_connect "unix://" port connects
+   to a kdb instance on the same machine through its Unix domain socket
+   (the one q -p port listens on), which is faster than loopback TCP. *)
 val q_connect : string -> int -> q_conn
 
 (* COULDDO: export funs to check invariants of dicts and tables, as well as
@@ -99,6 +106,77 @@ external q_rpc_async : q_conn -> string -> q_val -> unit = "q_rpc_async"
 
 external q_rpc : q_conn -> string -> q_val -> q_val = "q_rpc"
 
+external q_close : q_conn -> unit = "q_close"
+
+(* Fan-out queries.
+
+   q_fanout conns timeouts query sends query to every connection at once
+   and decodes the replies as they arrive, so the call takes as long as
+   the slowest shard rather than the sum of all of them. timeouts.(i) is
+   the deadline, in seconds from the call, of conns.(i). The i-th result
+   is the reply of conns.(i) (Q_unit unless its status is Shard_ok).
+
+   A shard that misses its deadline is shut down, because its reply could
+   otherwise be read as the reply to a later query: close it with q_close
+   and reconnect.
+
+   q_fanout, q_fanout_merge, q_eval_timeout and q_rpc_timeout release the
+   runtime lock while they wait, so other threads can run meanwhile, as
+   long as they do not use the same connections. *)
+
+type q_shard_status =
+  | Shard_ok
+  | Shard_error of string
+  | Shard_timeout
+
+external q_fanout : q_conn array -> float array -> string -> q_val array * q_shard_status array = "q_fanout"
+
+(* q_fanout_merge ?sort_col conns timeouts query merges the tables
+   returned by the shards into one table, copying each column once into a
+   preallocated result. Replies that are not tables, or whose column names
+   and types differ from the first table, are reported as Shard_error and
+   left out. Without sort_col the tables are concatenated in the order of
+   conns; with it, each table must be sorted on that column and the rows
+   are merged in order. The result is Q_unit if no shard returned a table. *)
+
+val q_fanout_merge : ?sort_col:string -> q_conn array -> float array -> string -> q_val * q_shard_status array
+
+(* q_merge_tables ?sort_col tables merges tables as q_fanout_merge merges
+   the replies of its shards, without a connection. Fails if one of them is
+   not a table or does not match the schema of the first one. *)
+val q_merge_tables : ?sort_col:string -> q_val array -> q_val
+
+
+(* Export to the Apache Arrow C Data Interface.
+
+   q_arrow_export v array schema fills in the ArrowArray and ArrowSchema
+   structs at addresses array and schema (allocated by the consumer, or by
+   q_arrow_alloc). v must be a vector (Q_v_*) or a Q_table whose columns
+   are vectors; a table is exported as a struct array. Where the layout
+   allows it, Arrow buffers point into the bigarrays of v, which is kept
+   alive until the consumer calls the release callbacks.
+
+   Type mapping: bools -> boolean (bit packed copy), bytes -> uint8,
+   shorts -> int16, int32/int64/float32/float64 as is, chars ->
+   fixed_size_binary(1), symbols -> dictionary<int32, large_utf8>,
+   Q_v_string -> large_utf8, months and dates -> date32, datetimes ->
+   timestamp[ms], minutes and seconds -> time32[s], times -> time32[ms].
+   Q nulls (including the null symbol) are marked in validity bitmaps, and
+   the fields of types that have a null are flagged nullable. Q does not
+   check the encoding of symbols and strings: they are exported as
+   large_utf8 only if they are all valid UTF-8, and as large_binary
+   otherwise. Fails if the offsets of a Q_v_string are malformed.
+*)
+
+external q_arrow_export : q_val -> nativeint -> nativeint -> unit = "q_arrow_export"
+
+(* Allocate an empty (ArrowArray, ArrowSchema) pair of structs *)
+external q_arrow_alloc : unit -> nativeint * nativeint = "q_arrow_alloc"
+
+(* Release (if not already released or moved) and free a pair allocated by
+   q_arrow_alloc *)
+external q_arrow_free : nativeint * nativeint -> unit = "q_arrow_free"
+
 
 (* Note: sending a mixed list and receiving it back via the q identity 
    function is not always idempotent. For instance, if we construct a mixed 
@@ -106,3 +184,162 @@ external q_rpc : q_conn -> string -> q_val -> q_val = "q_rpc"
    it into 01b (a bool vector). 
 *)
 
+
+(* Lazy views over replies.
+
+   q_eval_view and q_rpc_view keep the reply in its kdb form instead of
+   converting all of it; the reply is freed when the last view into it is
+   collected. Navigating a view (index, column, find, keys, values) does
+   not convert anything, and only the parts passed to q_view_value are
+   converted to q_val. Both sub-views and converted values are cached in
+   the view they were obtained from. Converted values hold copies of the
+   data, so they stay valid after the view has been collected. *)
+
+type q_view
+
+val q_eval_view : q_conn -> string -> q_view
+
+val q_rpc_view : q_conn -> string -> q_val -> q_view
+
+(* A view over v converted to its kdb form, as q_rpc sends it. Needs no
+   connection *)
+val q_view_of_val : q_val -> q_view
+
+(* The q type number (e.g. -7 for a long, 7 for a long vector, 98 for a
+   table) *)
+val q_view_type : q_view -> int
+
+(* Number of elements of a list, rows of a table, or keys of a dictionary
+   (1 for atoms) *)
+val q_view_count : q_view -> int
+
+(* Element of a list or vector *)
+val q_view_index : q_view -> int -> q_view
+
+(* Column of a table or keyed table. Raises Not_found *)
+val q_view_column : q_view -> string -> q_view
+
+(* Value for a symbol key of a dictionary. Raises Not_found *)
+val q_view_find : q_view -> string -> q_view
+
+val q_view_keys : q_view -> q_view
+
+val q_view_values : q_view -> q_view
+
+val q_view_value : q_view -> q_val
+
+
+(* Tickerplant journals.
+
+   q_journal_open maps a tickerplant log file into memory (it is unmapped
+   when the journal is collected). q_journal_validate returns the number of
+   complete messages and whether the file ends with a truncated message,
+   like -11!(-2;file) in q.
+
+   q_journal_replay ?first ?last ?tables journal f calls f table data for
+   every logged message (`upd; `table; data) with index in [first, last)
+   (default: all of them) whose table is in tables (default: all tables),
+   and returns the number of calls. Messages that are filtered out are not
+   decoded, and a truncated last message is skipped. data is decoded
+   directly from the file, without a q process. Messages with values that
+   have no q_val form (timestamps, timespans, lambdas, ...) are passed to
+   on_error index reason instead of f, and replay goes on with the next
+   message; the default on_error prints them to stderr. *)
+
+type q_journal
+
+external q_journal_open : string -> q_journal = "q_journal_open"
+
+external q_journal_validate : q_journal -> int * bool = "q_journal_validate"
+
+val q_journal_replay : ?first:int -> ?last:int -> ?tables:string list -> ?on_error:(int -> string -> unit) -> q_journal -> (string -> q_val -> unit) -> int
+
+
+(* Serialisation in the kdb IPC format.
+
+   q_serialize v returns the same bytes as -8!v in q, and q_deserialize
+   reads them back (-9!). q_write_file writes those bytes to a file, which
+   q can read with -9!read1`:path. The file is written and synced under a
+   temporary name, then renamed over path, so it is replaced as a whole;
+   errors fail with Failure.
+
+   q_map_value_file maps such a file into memory and checks it.
+   q_mapped_value decodes the value in it, copying the vectors out of the
+   mapping. q_read_file maps, decodes and copies a file in one go.
+
+   q_mapped_value_unsafe decodes without copying: its vectors point into
+   the mapping, which nothing in them keeps alive. The caller must keep
+   the q_mapped_file reachable for as long as the value (or any vector
+   in it) is used, or reading the vectors crashes. *)
+
+external q_serialize : q_val -> string = "q_serialize"
+
+external q_deserialize : string -> q_val = "q_deserialize"
+
+external q_write_file : string -> q_val -> unit = "q_write_file"
+
+type q_mapped_file
+
+external q_map_value_file : string -> q_mapped_file = "q_map_value_file"
+
+val q_mapped_value : q_mapped_file -> q_val
+
+val q_mapped_value_unsafe : q_mapped_file -> q_val
+
+val q_read_file : string -> q_val
+
+
+(* Batches.
+
+   q_eval_batch sends several queries in one message and returns their
+   results in order, after one round trip. q_rpc_batch does the same for
+   (function, argument) calls, each evaluated as q_rpc would. Each item is
+   evaluated on its own: an item that fails gives Q_error with the q error
+   message, and does not affect the other items. So does an item whose
+   result cannot be converted to q_val (e.g. a lambda or a timestamp), with
+   a "Not supported: ..." message. *)
+
+type q_result =
+  | Q_ok of q_val
+  | Q_error of string
+
+external q_eval_batch : q_conn -> string array -> q_result array = "q_eval_batch"
+
+external q_rpc_batch : q_conn -> (string * q_val) array -> q_result array = "q_rpc_batch"
+
+
+(* Deadlines.
+
+   q_connect_timeout host port timeout connects like q_connect, but gives
+   up after timeout seconds (connecting and the handshake; the clock starts
+   after the host name has been resolved, which the timeout does not
+   bound). q_eval_timeout and q_rpc_timeout give up when sending the query
+   or reading the reply stalls for timeout seconds (each socket write or
+   read is bounded, not their total). Both raise Q_timeout. After a query times out the handle is shut down,
+   because a late reply would otherwise be read as the reply to the next
+   query: close it with q_close and reconnect (or fail over to another
+   instance). Errors in q raise Failure, as with q_eval.
+
+   A q_slo collects latency statistics, e.g. one per pool of replicas:
+   the number of calls, of calls slower than the target latency (in
+   seconds), of timeouts and of other errors, and the total and maximum
+   latency. Pass it as ?slo to the calls to be measured. *)
+
+exception Q_timeout of string
+
+val q_connect_timeout : string -> int -> float -> q_conn
+
+type q_slo = { slo_target: float;
+               mutable slo_calls: int;
+               mutable slo_over_target: int;
+               mutable slo_timeouts: int;
+               mutable slo_errors: int;
+               mutable slo_total_time: float;
+               mutable slo_max_time: float }
+
+val q_slo_create : float -> q_slo
+
+val q_eval_timeout : ?slo:q_slo -> q_conn -> float -> string -> q_val
+
+val q_rpc_timeout : ?slo:q_slo -> q_conn -> float -> string -> q_val -> q_val
+
@@ -0,0 +1,633 @@
+/*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_arrow.c
+ */
+
+// Export of Q values to the Apache Arrow C Data Interface.
+//
+// Columns whose memory layout is already the Arrow one are exported without
+// copying: the Arrow buffers point into the bigarrays of the q_val, and the
+// q_val is registered as a caml global root until the consumer calls the
+// release callback. This relies on the bigarrays owning their storage, as
+// the ones built by q_to_caml and q_deserialize do. Columns that need a
+// different layout (bools are bit packed in Arrow, symbols become
+// dictionaries, some temporal types use a different epoch or unit) are
+// converted into buffers owned by the export and freed by the release
+// callback.
+//
+// Symbols and strings are exported as utf8 when all of them are valid
+// UTF-8, and as binary otherwise (q does not check the encoding).
+//
+// Q nulls (0Nh, 0Ni, 0Nj, 0Ne, 0n, 0Nm, 0Nd, 0Nz, 0Nu, 0Nv, 0Nt and the
+// null symbol) are marked in a validity bitmap, which is only allocated
+// when the column has nulls. The data buffers keep the sentinel values.
+//
+// Release callbacks remove caml global roots, so they must be called from
+// a thread that holds the caml runtime lock.
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/fail.h>
+#include <caml/bigarray.h>
+#include "q_interface.h"
+#include "q_caml.h"
+#include "q_arrow.h"
+
+// Days from 1970.01.01 (the Arrow epoch) to 2000.01.01 (the q epoch)
+#define Q_EPOCH_DAYS 10957
+#define MS_PER_DAY 86400000.0
+#define MAX_OWNED 3
+
+struct arrow_private {
+  value root;                 // q_val the buffers point into (if rooted)
+  int rooted;
+  int n_owned;
+  void *owned[MAX_OWNED];     // buffers allocated by the export
+  const void *buffers[3];
+};
+
+
+///////////////////////////////////////////////
+// Allocation and release of the Arrow structs
+///////////////////////////////////////////////
+
+static void *xcalloc(const size_t count, const size_t size) {
+  // calloc(0, ..) may return NULL
+  void *p = calloc(count ? count : 1, size ? size : 1);
+  if (NULL == p) {
+    caml_raise_out_of_memory();
+  }
+  return p;
+}
+
+static char *xstrdup(const char *s) {
+  char *p = xcalloc(strlen(s) + 1, 1);
+  strcpy(p, s);
+  return p;
+}
+
+static void release_array(struct ArrowArray *arr) {
+  struct arrow_private *priv = arr->private_data;
+  int64_t i;
+
+  for (i = 0; i < arr->n_children; i++) {
+    struct ArrowArray *child = arr->children[i];
+    if (NULL != child->release) {
+      child->release(child);
+    }
+    free(child);
+  }
+  free(arr->children);
+  if (NULL != arr->dictionary) {
+    if (NULL != arr->dictionary->release) {
+      arr->dictionary->release(arr->dictionary);
+    }
+    free(arr->dictionary);
+  }
+  if (priv->rooted) {
+    caml_remove_global_root(&priv->root);
+  }
+  for (i = 0; i < priv->n_owned; i++) {
+    free(priv->owned[i]);
+  }
+  free(priv);
+  arr->release = NULL;
+}
+
+static void release_schema(struct ArrowSchema *sch) {
+  int64_t i;
+
+  free((char *)sch->format);
+  free((char *)sch->name);
+  for (i = 0; i < sch->n_children; i++) {
+    struct ArrowSchema *child = sch->children[i];
+    if (NULL != child->release) {
+      child->release(child);
+    }
+    free(child);
+  }
+  free(sch->children);
+  if (NULL != sch->dictionary) {
+    if (NULL != sch->dictionary->release) {
+      sch->dictionary->release(sch->dictionary);
+    }
+    free(sch->dictionary);
+  }
+  sch->release = NULL;
+}
+
+// Initialise arr. If root is a block, the buffers of arr may point into it
+// and it is kept alive until arr is released.
+static struct arrow_private *init_array(struct ArrowArray *arr, value root,
+                                        const int64_t length,
+                                        const int n_buffers,
+                                        const int n_children) {
+  struct arrow_private *priv = xcalloc(1, sizeof(struct arrow_private));
+  int i;
+
+  assert(n_buffers <= 3);
+
+  if (Is_block(root)) {
+    priv->root = root;
+    priv->rooted = 1;
+    caml_register_global_root(&priv->root);
+  }
+  arr->length = length;
+  arr->null_count = 0;
+  arr->offset = 0;
+  arr->n_buffers = n_buffers;
+  arr->n_children = n_children;
+  arr->buffers = priv->buffers;
+  arr->children = NULL;
+  if (n_children > 0) {
+    arr->children = xcalloc(n_children, sizeof(struct ArrowArray *));
+    for (i = 0; i < n_children; i++) {
+      arr->children[i] = xcalloc(1, sizeof(struct ArrowArray));
+    }
+  }
+  arr->dictionary = NULL;
+  arr->release = release_array;
+  arr->private_data = priv;
+  return priv;
+}
+
+static void init_schema(struct ArrowSchema *sch, const char *format,
+                        const char *name, const int n_children) {
+  int i;
+
+  sch->format = xstrdup(format);
+  sch->name = xstrdup(name);
+  sch->metadata = NULL;
+  sch->flags = 0;
+  sch->n_children = n_children;
+  sch->children = NULL;
+  if (n_children > 0) {
+    sch->children = xcalloc(n_children, sizeof(struct ArrowSchema *));
+    for (i = 0; i < n_children; i++) {
+      sch->children[i] = xcalloc(1, sizeof(struct ArrowSchema));
+    }
+  }
+  sch->dictionary = NULL;
+  sch->release = release_schema;
+  sch->private_data = NULL;
+}
+
+static void *own_buffer(struct arrow_private *priv, const size_t size) {
+  assert(priv->n_owned < MAX_OWNED);
+
+  void *buf = xcalloc(size, 1);
+  priv->owned[priv->n_owned++] = buf;
+  return buf;
+}
+
+
+///////////////////////////////////////////////
+// Export of vectors
+///////////////////////////////////////////////
+
+static long vector_length(const value v) {
+  switch (Tag_val(v)) {
+  case tag_v_symbol: return Wosize_val(Field(v, 0));
+  case tag_v_string: return Bigarray_val(Field(v, 1))->dim[0] - 1;
+  default:           return Bigarray_val(Field(v, 0))->dim[0];
+  }
+}
+
+// Days since 1970.01.01 of the first day of the given month (Howard
+// Hinnant's days_from_civil)
+static int32_t days_from_month(const int32_t q_month) {
+  const int32_t m0 = (q_month % 12 + 12) % 12;
+  const int32_t y0 = 2000 + (q_month - m0) / 12;
+  const int32_t m = m0 + 1;
+  const int32_t y = m <= 2 ? y0 - 1 : y0;
+  const int32_t era = (y >= 0 ? y : y - 399) / 400;
+  const int32_t yoe = y - era * 400;
+  const int32_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5;
+  const int32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+static void export_zero_copy(const value v, struct ArrowArray *arr,
+                             struct ArrowSchema *sch, const char *format,
+                             const char *name) {
+  struct arrow_private *priv = init_array(arr, v, vector_length(v), 2, 0);
+  priv->buffers[0] = NULL;
+  priv->buffers[1] = Data_bigarray_val(Field(v, 0));
+  init_schema(sch, format, name, 0);
+}
+
+static void export_bools(const value v, struct ArrowArray *arr,
+                         struct ArrowSchema *sch, const char *name) {
+  const long n = vector_length(v);
+  const unsigned char *bytes = Data_bigarray_val(Field(v, 0));
+  struct arrow_private *priv = init_array(arr, Val_unit, n, 2, 0);
+  unsigned char *bits = own_buffer(priv, (n + 7) / 8);
+  long i;
+
+  for (i = 0; i < n; i++) {
+    if (bytes[i]) {
+      bits[i / 8] |= (unsigned char)(1 << (i % 8));
+    }
+  }
+  priv->buffers[0] = NULL;
+  priv->buffers[1] = bits;
+  init_schema(sch, "b", name, 0);
+}
+
+// Months, dates and minutes: int32 values rescaled into an Arrow date32
+// or time32. Nulls (INT32_MIN) are kept as they are, for the validity
+// bitmap.
+static void export_int32_temporal(const value v, struct ArrowArray *arr,
+                                  struct ArrowSchema *sch, const char *name) {
+  const long n = vector_length(v);
+  const int tag = Tag_val(v);
+  const int32_t *src = Data_bigarray_val(Field(v, 0));
+  struct arrow_private *priv = init_array(arr, Val_unit, n, 2, 0);
+  int32_t *dst = own_buffer(priv, n * sizeof(int32_t));
+  long i;
+
+  for (i = 0; i < n; i++) {
+    const int32_t x = src[i];
+    if (INT32_MIN == x) {
+      dst[i] = x;
+    } else if (tag_v_month == tag) {
+      dst[i] = days_from_month(x);
+    } else if (tag_v_date == tag) {
+      dst[i] = x + Q_EPOCH_DAYS;
+    } else {
+      assert(tag_v_minute == tag);
+      dst[i] = x * 60;
+    }
+  }
+  priv->buffers[0] = NULL;
+  priv->buffers[1] = dst;
+  init_schema(sch, tag_v_minute == tag ? "tts" : "tdD", name, 0);
+}
+
+// Datetimes (fractional days since 2000.01.01) become millisecond
+// timestamps. 0Nz becomes INT64_MIN (and is marked in the validity bitmap).
+static void export_datetimes(const value v, struct ArrowArray *arr,
+                             struct ArrowSchema *sch, const char *name) {
+  const long n = vector_length(v);
+  const double *src = Data_bigarray_val(Field(v, 0));
+  struct arrow_private *priv = init_array(arr, Val_unit, n, 2, 0);
+  int64_t *dst = own_buffer(priv, n * sizeof(int64_t));
+  long i;
+
+  for (i = 0; i < n; i++) {
+    dst[i] = isnan(src[i]) ? INT64_MIN
+                           : llround((src[i] + Q_EPOCH_DAYS) * MS_PER_DAY);
+  }
+  priv->buffers[0] = NULL;
+  priv->buffers[1] = dst;
+  init_schema(sch, "tsm:", name, 0);
+}
+
+// Whether the len bytes at s are valid UTF-8 (no overlong forms,
+// surrogates or code points past U+10FFFF)
+static int is_utf8(const unsigned char *s, const size_t len) {
+  size_t i = 0;
+
+  while (i < len) {
+    const unsigned char c = s[i];
+    int n;
+    unsigned char lo = 0x80, hi = 0xbf;
+    if (c < 0x80) {
+      i++;
+      continue;
+    } else if (c >= 0xc2 && c <= 0xdf) {
+      n = 1;
+    } else if (c >= 0xe0 && c <= 0xef) {
+      n = 2;
+      if (0xe0 == c) lo = 0xa0;
+      if (0xed == c) hi = 0x9f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      n = 3;
+      if (0xf0 == c) lo = 0x90;
+      if (0xf4 == c) hi = 0x8f;
+    } else {
+      return 0;
+    }
+    if (len - i <= (size_t)n || s[i + 1] < lo || s[i + 1] > hi) {
+      return 0;
+    }
+    int j;
+    for (j = 2; j <= n; j++) {
+      if ((s[i + j] & 0xc0) != 0x80) {
+        return 0;
+      }
+    }
+    i += n + 1;
+  }
+  return 1;
+}
+
+// large_utf8 if every string is valid UTF-8, otherwise large_binary
+static void export_strings(const value v, struct ArrowArray *arr,
+                           struct ArrowSchema *sch, const char *name) {
+  const long n = vector_length(v);
+  const unsigned char *chars = Data_bigarray_val(Field(v, 0));
+  const int64_t *offs = Data_bigarray_val(Field(v, 1));
+  struct arrow_private *priv = init_array(arr, v, n, 3, 0);
+  int utf8 = 1;
+  long i;
+
+  for (i = 0; utf8 && i < n; i++) {
+    utf8 = is_utf8(chars + offs[i], offs[i + 1] - offs[i]);
+  }
+  priv->buffers[0] = NULL;
+  priv->buffers[1] = offs;
+  priv->buffers[2] = chars;
+  init_schema(sch, utf8 ? "U" : "Z", name, 0);
+}
+
+static uint64_t hash_string(const char *s) {
+  uint64_t h = 14695981039346656037ULL; // FNV-1a
+  while (*s) {
+    h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+  }
+  return h;
+}
+
+// Symbols become a dictionary array: int32 indices into a large_utf8
+// array of the distinct symbols, in order of first occurrence.
+static void export_symbols(const value v, struct ArrowArray *arr,
+                           struct ArrowSchema *sch, const char *name) {
+  const value syms = Field(v, 0);
+  const long n = vector_length(v);
+  struct arrow_private *priv = init_array(arr, Val_unit, n, 2, 0);
+  int32_t *indices = own_buffer(priv, n * sizeof(int32_t));
+  long i;
+
+  // Open addressing table of indices into 'distinct', -1 if empty
+  long table_size = 16;
+  while (table_size < 2 * n) {
+    table_size *= 2;
+  }
+  long *table = xcalloc(table_size, sizeof(long));
+  long *distinct = xcalloc(n, sizeof(long));
+  long n_distinct = 0;
+  size_t n_chars = 0;
+  for (i = 0; i < table_size; i++) {
+    table[i] = -1;
+  }
+  for (i = 0; i < n; i++) {
+    const char *s = String_val(Field(syms, i));
+    long slot = hash_string(s) & (table_size - 1);
+    while (table[slot] >= 0 &&
+           0 != strcmp(s, String_val(Field(syms, distinct[table[slot]])))) {
+      slot = (slot + 1) & (table_size - 1);
+    }
+    if (table[slot] < 0) {
+      table[slot] = n_distinct;
+      distinct[n_distinct++] = i;
+      n_chars += caml_string_length(Field(syms, i));
+    }
+    indices[i] = (int32_t)table[slot];
+  }
+  free(table);
+
+  priv->buffers[0] = NULL;
+  priv->buffers[1] = indices;
+  init_schema(sch, "i", name, 0);
+
+  // The dictionary
+  struct ArrowArray *dict = xcalloc(1, sizeof(struct ArrowArray));
+  struct ArrowSchema *dict_sch = xcalloc(1, sizeof(struct ArrowSchema));
+  struct arrow_private *dict_priv = init_array(dict, Val_unit, n_distinct, 3, 0);
+  int64_t *offsets = own_buffer(dict_priv, (n_distinct + 1) * sizeof(int64_t));
+  char *chars = own_buffer(dict_priv, n_chars);
+  size_t pos = 0;
+  int utf8 = 1;
+  for (i = 0; i < n_distinct; i++) {
+    const value s = Field(syms, distinct[i]);
+    const size_t len = caml_string_length(s);
+    offsets[i] = pos;
+    memcpy(chars + pos, String_val(s), len);
+    utf8 = utf8 && is_utf8((const unsigned char *)chars + pos, len);
+    pos += len;
+  }
+  offsets[n_distinct] = pos;
+  free(distinct);
+  dict_priv->buffers[0] = NULL;
+  dict_priv->buffers[1] = offsets;
+  dict_priv->buffers[2] = chars;
+  init_schema(dict_sch, utf8 ? "U" : "Z", "", 0);
+
+  arr->dictionary = dict;
+  sch->dictionary = dict_sch;
+}
+
+// Whether vectors with this tag can hold q nulls
+static int is_nullable(const int tag) {
+  switch (tag) {
+  case tag_v_bool:
+  case tag_v_byte:
+  case tag_v_char:
+  case tag_v_string:
+    return 0;
+  default:
+    return 1;
+  }
+}
+
+// Whether element i of a vector (its tag, data and, for symbols, its
+// string array) is the q null of its type
+static inline int is_null(const int tag, const void *data, const value syms,
+                          const long i) {
+  switch (tag) {
+  case tag_v_int16:    return INT16_MIN == ((const int16_t *)data)[i];
+  case tag_v_int64:    return INT64_MIN == ((const int64_t *)data)[i];
+  case tag_v_float32:  return isnan(((const float *)data)[i]);
+  case tag_v_float64:
+  case tag_v_datetime: return isnan(((const double *)data)[i]);
+  case tag_v_symbol:   return 0 == caml_string_length(Field(syms, i));
+  default:             return INT32_MIN == ((const int32_t *)data)[i];
+  }
+}
+
+// Mark the nulls of v in a validity bitmap of arr (no bitmap if v has no
+// nulls), and set the null count
+static void export_validity(const value v, struct ArrowArray *arr) {
+  struct arrow_private *priv = arr->private_data;
+  const int tag = Tag_val(v);
+  const value syms = (tag_v_symbol == tag) ? Field(v, 0) : Val_unit;
+  const void *data = (tag_v_symbol == tag) ? NULL : Data_bigarray_val(Field(v, 0));
+  const long n = arr->length;
+  unsigned char *bits = NULL;
+  long i, nulls = 0;
+
+  for (i = 0; i < n; i++) {
+    if (is_null(tag, data, syms, i)) {
+      if (NULL == bits) {
+        bits = own_buffer(priv, (n + 7) / 8);
+        memset(bits, 0xff, (n + 7) / 8);
+      }
+      bits[i / 8] &= (unsigned char)~(1 << (i % 8));
+      nulls++;
+    }
+  }
+  arr->null_count = nulls;
+  priv->buffers[0] = bits;
+}
+
+static void export_vector(const value v, struct ArrowArray *arr,
+                          struct ArrowSchema *sch, const char *name) {
+  switch (Tag_val(v)) {
+  case tag_v_bool:     export_bools(v, arr, sch, name); break;
+  case tag_v_byte:     export_zero_copy(v, arr, sch, "C", name); break;
+  case tag_v_int16:    export_zero_copy(v, arr, sch, "s", name); break;
+  case tag_v_int32:    export_zero_copy(v, arr, sch, "i", name); break;
+  case tag_v_int64:    export_zero_copy(v, arr, sch, "l", name); break;
+  case tag_v_float32:  export_zero_copy(v, arr, sch, "f", name); break;
+  case tag_v_float64:  export_zero_copy(v, arr, sch, "g", name); break;
+  case tag_v_char:     export_zero_copy(v, arr, sch, "w:1", name); break;
+  case tag_v_second:   export_zero_copy(v, arr, sch, "tts", name); break;
+  case tag_v_time:     export_zero_copy(v, arr, sch, "ttm", name); break;
+  case tag_v_month:
+  case tag_v_date:
+  case tag_v_minute:   export_int32_temporal(v, arr, sch, name); break;
+  case tag_v_datetime: export_datetimes(v, arr, sch, name); break;
+  case tag_v_symbol:   export_symbols(v, arr, sch, name); break;
+  case tag_v_string:   export_strings(v, arr, sch, name); break;
+  default: {
+    caml_failwith("q_arrow_export: impossible tag");
+  }
+  }
+  if (is_nullable(Tag_val(v))) {
+    export_validity(v, arr);
+    sch->flags |= ARROW_FLAG_NULLABLE;
+  }
+}
+
+
+///////////////////////////////////////////////
+// Export of tables
+///////////////////////////////////////////////
+
+static int is_vector(const value v) {
+  if (!Is_block(v)) {
+    return 0;
+  }
+  const int tag = Tag_val(v);
+  return (tag_v_bool <= tag && tag <= tag_v_string);
+}
+
+// Check a vector to export: the offsets of a Q_v_string must be valid,
+// as its Arrow array points into them
+static void check_vector(const value v) {
+  if (tag_v_string == Tag_val(v)) {
+    check_string_offsets(v, "q_arrow_export");
+  }
+}
+
+// Check the whole value before allocating anything, so that a failure does
+// not leave a half-built export behind
+static void check_exportable(const value v) {
+  if (is_vector(v)) {
+    check_vector(v);
+    return;
+  }
+  if (!Is_block(v) || tag_table != Tag_val(v)) {
+    caml_failwith("q_arrow_export: only vectors and tables can be exported");
+  }
+
+  const value tbl = Field(v, 0);
+  const value colnames = Field(tbl, 0);
+  const value cols = Field(tbl, 1);
+  if (tag_v_symbol != Tag_val(colnames) || tag_mixed_list != Tag_val(cols)) {
+    caml_failwith("q_arrow_export: malformed table");
+  }
+  const value names = Field(colnames, 0);
+  const value arr = Field(cols, 0);
+  if (Wosize_val(names) != Wosize_val(arr)) {
+    caml_failwith("q_arrow_export: malformed table");
+  }
+
+  unsigned long i;
+  for (i = 0; i < Wosize_val(arr); i++) {
+    if (!is_vector(Field(arr, i))) {
+      caml_failwith("q_arrow_export: table columns must be vectors");
+    }
+    check_vector(Field(arr, i));
+    if (vector_length(Field(arr, i)) != vector_length(Field(arr, 0))) {
+      caml_failwith("q_arrow_export: table columns differ in length");
+    }
+  }
+}
+
+// A table is exported as a struct array with one child per column
+static void export_table(const value v, struct ArrowArray *arr,
+                         struct ArrowSchema *sch) {
+  const value tbl = Field(v, 0);
+  const value names = Field(Field(tbl, 0), 0);
+  const value cols = Field(Field(tbl, 1), 0);
+  const long n_cols = Wosize_val(cols);
+  const long n_rows = n_cols > 0 ? vector_length(Field(cols, 0)) : 0;
+  long i;
+
+  struct arrow_private *priv = init_array(arr, Val_unit, n_rows, 1, n_cols);
+  priv->buffers[0] = NULL;
+  init_schema(sch, "+s", "", n_cols);
+  for (i = 0; i < n_cols; i++) {
+    export_vector(Field(cols, i), arr->children[i], sch->children[i],
+                  String_val(Field(names, i)));
+  }
+}
+
+
+///////////////////////////////////////////////
+// Exported Caml functions
+///////////////////////////////////////////////
+
+CAMLprim value q_arrow_export(value v, value array_addr, value schema_addr)
+{
+  CAMLparam3(v, array_addr, schema_addr);
+
+  struct ArrowArray *arr = (struct ArrowArray *)Nativeint_val(array_addr);
+  struct ArrowSchema *sch = (struct ArrowSchema *)Nativeint_val(schema_addr);
+
+  check_exportable(v);
+  if (is_vector(v)) {
+    export_vector(v, arr, sch, "");
+  } else {
+    export_table(v, arr, sch);
+  }
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value q_arrow_alloc(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal1(result);
+
+  struct ArrowArray *arr = xcalloc(1, sizeof(struct ArrowArray));
+  struct ArrowSchema *sch = xcalloc(1, sizeof(struct ArrowSchema));
+  result = caml_alloc_tuple(2);
+  Store_field(result, 0, caml_copy_nativeint((intnat)arr));
+  Store_field(result, 1, caml_copy_nativeint((intnat)sch));
+  CAMLreturn(result);
+}
+
+CAMLprim value q_arrow_free(value structs)
+{
+  CAMLparam1(structs);
+
+  struct ArrowArray *arr = (struct ArrowArray *)Nativeint_val(Field(structs, 0));
+  struct ArrowSchema *sch = (struct ArrowSchema *)Nativeint_val(Field(structs, 1));
+  if (NULL != arr->release) {
+    arr->release(arr);
+  }
+  if (NULL != sch->release) {
+    sch->release(sch);
+  }
+  free(arr);
+  free(sch);
+  CAMLreturn(Val_unit);
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_arrow.h
+ */
+
+#ifndef _Q_ARROW_H_
+#define	_Q_ARROW_H_
+
+#include <stdint.h>
+
+// The Apache Arrow C Data Interface. These definitions are part of a stable
+// ABI and are copied verbatim from the Arrow specification
+// (https://arrow.apache.org/docs/format/CDataInterface.html); no Arrow
+// library is needed to build or use them.
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  // Array type description
+  const char* format;
+  const char* name;
+  const char* metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema** children;
+  struct ArrowSchema* dictionary;
+
+  // Release callback
+  void (*release)(struct ArrowSchema*);
+  // Opaque producer-specific data
+  void* private_data;
+};
+
+struct ArrowArray {
+  // Array data description
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void** buffers;
+  struct ArrowArray** children;
+  struct ArrowArray* dictionary;
+
+  // Release callback
+  void (*release)(struct ArrowArray*);
+  // Opaque producer-specific data
+  void* private_data;
+};
+
+#endif  // ARROW_C_DATA_INTERFACE
+
+#endif /* _Q_ARROW_H_ */
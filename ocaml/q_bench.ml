@@ -0,0 +1,34 @@
+(*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_bench.ml
+ *
+ * Round-trip latency of small queries to a local kdb instance, over
+ * loopback TCP and over the Unix domain socket.
+ *
+ * Usage: q_bench [port [iterations]]
+ *)
+
+open Q
+
+let time_calls q_conn query n =
+  (* Warm up *)
+  for i = 1 to 100 do ignore (q_eval q_conn query) done;
+  let start = Unix.gettimeofday () in
+  for i = 1 to n do ignore (q_eval q_conn query) done;
+  (Unix.gettimeofday () -. start) /. (float_of_int n)
+
+let () =
+  let port = if Array.length Sys.argv > 1 then int_of_string Sys.argv.(1) else 5001 in
+  let n = if Array.length Sys.argv > 2 then int_of_string Sys.argv.(2) else 100000 in
+  let tcp = q_connect "localhost" port in
+  let uds = q_connect "unix://" port in
+  List.iter
+    (fun query ->
+      let t_tcp = time_calls tcp query n in
+      let t_uds = time_calls uds query n in
+      Printf.printf "%-16s tcp %8.2f us/call   unix %8.2f us/call   (%.2fx)\n"
+        query (t_tcp *. 1e6) (t_uds *. 1e6) (t_tcp /. t_uds))
+    [ "1+1"; "til 100"; "til 10000" ];
+  q_close tcp;
+  q_close uds
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_caml.h
+ */
+
+#ifndef _Q_CAML_H_
+#define	_Q_CAML_H_
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/fail.h>
+#include <caml/bigarray.h>
+#include "q_interface.h"
+
+// Helpers to build Caml values, shared by the C files of the library and
+// not part of its interface. They are static so that they do not clash
+// with the symbols of other libraries linked into the same program.
+
+static inline value mk_caml_value(const int tag, value v) {
+  CAMLparam1(v);
+  CAMLlocal1(result);
+
+  result = caml_alloc(1, tag);
+  Store_field(result, 0, v);
+  CAMLreturn(result);
+}
+
+static inline value mk_caml_value_two(const int tag, value v, value attrib) {
+  CAMLparam2(v, attrib);
+  CAMLlocal1(result);
+
+  assert(Is_block(v));
+  assert(Is_long(attrib));
+
+  result = caml_alloc(2, tag);
+  Store_field(result, 0, v);
+  Store_field(result, 1, attrib);
+  CAMLreturn(result);
+}
+
+static inline value mk_caml_value_three(const int tag, value v1, value v2, value attrib) {
+  CAMLparam3(v1, v2, attrib);
+  CAMLlocal1(result);
+
+  assert(Is_block(v1));
+  assert(Is_block(v2));
+  assert(Is_long(attrib));
+
+  result = caml_alloc(3, tag);
+  Store_field(result, 0, v1);
+  Store_field(result, 1, v2);
+  Store_field(result, 2, attrib);
+  CAMLreturn(result);
+}
+
+static inline value mk_caml_pair(value fst, value snd) {
+  CAMLparam2(fst, snd);
+  CAMLlocal1(result);
+
+  result = caml_alloc_tuple(2);
+  Store_field(result, 0, fst);
+  Store_field(result, 1, snd);
+  CAMLreturn(result);
+}
+
+static inline int tag_for_scalar(const int ty) {
+  switch(ty){
+  case (t_int32):  return tag_int32;
+  case (t_month):  return tag_month;
+  case (t_date):   return tag_date;
+  case (t_minute): return tag_minute;
+  case (t_second): return tag_second;
+  case (t_time):   return tag_time;
+  default: {
+    caml_failwith("tag_for_scalar: impossible tag\n");
+  }
+  }
+}
+
+static inline int tag_for_vector(const int ty) {
+  switch(ty){
+  case (-t_bool):     return tag_v_bool;
+  case (-t_byte):     return tag_v_byte;
+  case (-t_int16):    return tag_v_int16;
+  case (-t_int32):    return tag_v_int32;
+  case (-t_int64):    return tag_v_int64;
+  case (-t_float32):  return tag_v_float32;
+  case (-t_float64):  return tag_v_float64;
+  case (-t_char):     return tag_v_char;
+  case (-t_month):    return tag_v_month;
+  case (-t_date):     return tag_v_date;
+  case (-t_datetime): return tag_v_datetime;
+  case (-t_minute):   return tag_v_minute;
+  case (-t_second):   return tag_v_second;
+  case (-t_time):     return tag_v_time;
+  default: {
+    caml_failwith("tag_for_vector: impossible tag\n");
+  }
+  }
+}
+
+
+// Check the offsets of a Q_v_string: offsets[0] is 0 and they do not
+// decrease or go past the end of the chars. Fails with a message that
+// starts with caller. Returns the number of strings.
+static inline long check_string_offsets(const value v, const char *caller) {
+  const value chars = Field(v,0);
+  const value offsets = Field(v,1);
+
+  assert (1 == Bigarray_val(chars)->num_dims);
+  assert (1 == Bigarray_val(offsets)->num_dims);
+
+  const long n_chars = Bigarray_val(chars)->dim[0];
+  const long n_offs = Bigarray_val(offsets)->dim[0];
+  const int64_t *offs = Data_bigarray_val(offsets);
+  int ok = (n_offs >= 1 && 0 == offs[0]);
+  long i;
+
+  for (i = 1; ok && i < n_offs; i++) {
+    ok = (offs[i-1] <= offs[i] && offs[i] <= n_chars);
+  }
+  if (!ok) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "%s: malformed Q_v_string offsets", caller);
+    caml_failwith(msg);
+  }
+  return n_offs - 1;
+}
+
+
+#endif /* _Q_CAML_H_ */
@@ -0,0 +1,86 @@
+(*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_check.ml
+ *
+ * Helpers shared by the q_test_* programs, which check the library
+ * without a kdb instance.
+ *)
+
+open Bigarray
+open Q
+
+let failures = ref 0
+
+let check name ok =
+  if ok then Printf.printf "ok      %s\n" name
+  else begin
+    incr failures;
+    Printf.printf "FAILED  %s\n" name
+  end
+
+let raises_failure f =
+  try ignore (f ()); false with Failure _ -> true
+
+(* Building values *)
+
+let ba kind l = Array1.of_array kind c_layout (Array.of_list l)
+
+let chars s =
+  let a = Array1.create char c_layout (String.length s) in
+  for i = 0 to String.length s - 1 do a.{i} <- s.[i] done;
+  a
+
+let strings l =
+  let offsets = Array1.create int64 c_layout (List.length l + 1) in
+  offsets.{0} <- 0L;
+  ignore (List.fold_left
+            (fun (i, pos) s ->
+              let pos = pos + String.length s in
+              offsets.{i + 1} <- Int64.of_int pos;
+              (i + 1, pos))
+            (0, 0) l);
+  Q_v_string (chars (String.concat "" l), offsets, A_none)
+
+let string_list v =
+  match v with
+  | Q_v_string (c, o, _) ->
+      let l = ref [] in
+      for i = Array1.dim o - 2 downto 0 do
+        let lo = Int64.to_int o.{i} and hi = Int64.to_int o.{i + 1} in
+        let s = Buffer.create (hi - lo) in
+        for j = lo to hi - 1 do Buffer.add_char s c.{j} done;
+        l := Buffer.contents s :: !l
+      done;
+      !l
+  | _ -> []
+
+let read_file path =
+  let ic = open_in_bin path in
+  let b = Buffer.create 256 in
+  Buffer.add_channel b ic (in_channel_length ic);
+  close_in ic;
+  Buffer.contents b
+
+let write_file path s =
+  let oc = open_out_bin path in
+  output_string oc s;
+  close_out oc
+
+(* A small table, with a string column *)
+let trades =
+  Q_table { colnames = Q_v_symbol ([| "sym"; "px"; "qty"; "note" |], A_none);
+            cols = Q_mixed_list [| Q_v_symbol ([| "a"; "b" |], A_none);
+                                   Q_v_float64 (ba float64 [1.5; 2.5], A_none);
+                                   Q_v_int64 (ba int64 [10L; 20L], A_none);
+                                   strings ["x"; "yz"] |];
+            attrib_t = A_none }
+
+
+(* Report and exit with status 1 if any check failed *)
+let finish () =
+  if !failures > 0 then begin
+    Printf.printf "%d check(s) failed\n" !failures;
+    exit 1
+  end else
+    print_endline "all checks passed"
@@ -8,20 +8,39 @@
 // #define NDEBUG
 
 #include <assert.h>
+#include <stddef.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
 #include <caml/mlvalues.h>
 #include <caml/alloc.h>
 #include <caml/memory.h>
 #include <caml/custom.h>
 #include <caml/fail.h>
+#include <caml/callback.h>
+#include <caml/signals.h>
 #include <caml/bigarray.h>
 #include "q_interface.h"
+#include "q_caml.h"
 
 // forward declarations
 
 static value q_to_caml(const K q_val);
 static K caml_to_q(const value v);
+static value mk_caml_array(const K q_val);
+static double now_seconds(void);
+static int poll_until(struct pollfd *fds, const int n, const double deadline);
 
 
 ///////////////////////////////////////////////
@@ -29,29 +48,6 @@ static K caml_to_q(const value v);
 ///////////////////////////////////////////////
 
 
-static value mk_caml_value(const int tag, value v) {
-  CAMLparam1(v);
-  CAMLlocal1(result);
-
-  result = caml_alloc(1, tag);
-  Store_field(result, 0, v);
-  CAMLreturn(result);
-}
-
-static value mk_caml_value_two(const int tag, value v, value attrib) {
-  CAMLparam2(v, attrib);
-  CAMLlocal1(result);
-
-  assert(Is_block(v));
-  assert(Is_long(attrib));
-
-  result = caml_alloc(2, tag);
-  Store_field(result, 0, v);
-  Store_field(result, 1, attrib);
-  CAMLreturn(result);
-}
-
-
 static value mk_caml_dict(const K q_val) {
   CAMLparam0 ();
   CAMLlocal1 (result);
@@ -71,12 +67,18 @@ static value mk_caml_table(const K q_val) {
 
   tbl = caml_alloc(3, 0);
   Store_field(tbl, 0, q_to_caml(kK(q_val->k)[0]));
-  Store_field(tbl, 1, q_to_caml(kK(q_val->k)[1]));
+  // Columns are always a Q_mixed_list, even when every column is a char
+  // vector (which q_to_caml would otherwise turn into a Q_v_string)
+  Store_field(tbl, 1, mk_caml_value(tag_mixed_list, mk_caml_array(kK(q_val->k)[1])));
   Store_field(tbl, 2, Val_int(q_val->u)); // Attribute
   CAMLreturn (mk_caml_value(tag_table, tbl));
 }
 
 
+// The bigarrays below are allocated (and freed) by caml and the data is
+// copied: q_val is usually part of a reply that is released (r0) as soon as
+// it has been converted, so the bigarray cannot point into it.
+
 static value mk_caml_byte_array(const int caml_tag, const K q_val) {
   CAMLparam0 ();
   CAMLlocal2 (attrib, arr);
@@ -84,18 +86,20 @@ static value mk_caml_byte_array(const int caml_tag, const K q_val) {
   long dims[1];
   dims[0] = q_val->n;
   attrib = Val_int(q_val->u);
-  arr = alloc_bigarray(BIGARRAY_UINT8 | BIGARRAY_C_LAYOUT, 1, kG(q_val), dims);
+  arr = alloc_bigarray(BIGARRAY_UINT8 | BIGARRAY_C_LAYOUT, 1, NULL, dims);
+  memcpy(Data_bigarray_val(arr), kG(q_val), q_val->n);
   CAMLreturn (mk_caml_value_two(caml_tag, arr, attrib));
 }
 
-static value mk_caml_scalar_array(const int caml_tag, const int arr_ty, void * data, const K q_val) {
+static value mk_caml_scalar_array(const int caml_tag, const int arr_ty, const size_t elem_size, const void * data, const K q_val) {
   CAMLparam0 ();
   CAMLlocal2 (attrib, arr);
 
   long dims[1];
   dims[0] = q_val->n;
   attrib = Val_int(q_val->u);
-  arr = alloc_bigarray(arr_ty | BIGARRAY_C_LAYOUT, 1, data, dims);
+  arr = alloc_bigarray(arr_ty | BIGARRAY_C_LAYOUT, 1, NULL, dims);
+  memcpy(Data_bigarray_val(arr), data, q_val->n * elem_size);
   CAMLreturn (mk_caml_value_two(caml_tag, arr, attrib));
 }
 
@@ -155,6 +159,62 @@ static value mk_caml_string_array_helper(const K q_val) {
   }
 }
 
+// A general list is a string column if it is non-empty and every element
+// is a char vector. (An empty general list carries no element types, so it
+// stays a Q_mixed_list.)
+static int is_string_column(const K q_val) {
+  assert(t_mixed_list == q_val->t);
+
+  const unsigned long size = q_val->n;
+  if (0 == size) {
+    return 0;
+  }
+  K *q_elems = kK(q_val);
+  unsigned long i;
+  for (i = 0; i < size; i++) {
+    if (-t_char != q_elems[i]->t) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Copy a list of char vectors into one char bigarray plus an int64 offsets
+// bigarray, instead of one Q_v_char bigarray per row.
+// The bigarrays are allocated (and freed) by caml.
+static value mk_caml_string_column(const K q_val) {
+  CAMLparam0 ();
+  CAMLlocal3 (attrib, chars, offsets);
+
+  const unsigned long size = q_val->n;
+  K *q_elems = kK(q_val);
+  unsigned long i;
+  long total = 0;
+  for (i = 0; i < size; i++) {
+    total += q_elems[i]->n;
+  }
+
+  long dims[1];
+  dims[0] = size + 1;
+  offsets = alloc_bigarray(BIGARRAY_INT64 | BIGARRAY_C_LAYOUT, 1, NULL, dims);
+  dims[0] = total;
+  chars = alloc_bigarray(BIGARRAY_UINT8 | BIGARRAY_C_LAYOUT, 1, NULL, dims);
+
+  int64_t *offs = Data_bigarray_val(offsets);
+  unsigned char *data = Data_bigarray_val(chars);
+  long pos = 0;
+  for (i = 0; i < size; i++) {
+    const long len = q_elems[i]->n;
+    offs[i] = pos;
+    memcpy(data + pos, kC(q_elems[i]), len);
+    pos += len;
+  }
+  offs[size] = pos;
+
+  attrib = Val_int(q_val->u);
+  CAMLreturn (mk_caml_value_three(tag_v_string, chars, offsets, attrib));
+}
+
 static value mk_caml_string_array(const K q_val) {
   CAMLparam0 ();
   CAMLlocal2 (attrib, arr);
@@ -165,43 +225,6 @@ static value mk_caml_string_array(const K q_val) {
 }
 
 
-static int tag_for_scalar(const int ty) {
-  switch(ty){
-  case (t_int32):  return tag_int32;
-  case (t_month):  return tag_month;
-  case (t_date):   return tag_date;
-  case (t_minute): return tag_minute;
-  case (t_second): return tag_second;
-  case (t_time):   return tag_time;
-  default: {
-    caml_failwith("tag_for_scalar: impossible tag\n");
-  }
-  }
-}
-
-static int tag_for_vector(const int ty) {
-  switch(ty){
-  case (-t_bool):     return tag_v_bool;
-  case (-t_byte):     return tag_v_byte;
-  case (-t_int16):    return tag_v_int16;
-  case (-t_int32):    return tag_v_int32;
-  case (-t_int64):    return tag_v_int64;
-  case (-t_float32):  return tag_v_float32;
-  case (-t_float64):  return tag_v_float64;
-  case (-t_char):     return tag_v_char;
-  case (-t_month):    return tag_v_month;
-  case (-t_date):     return tag_v_date;
-  case (-t_datetime): return tag_v_datetime;
-  case (-t_minute):   return tag_v_minute;
-  case (-t_second):   return tag_v_second;
-  case (-t_time):     return tag_v_time;
-  default: {
-    caml_failwith("tag_for_vector: impossible tag\n");
-  }
-  }
-}
-
-
 // Convert K->caml
 static value q_to_caml(const K q_val) {
   const H q_type = q_val->t; 
@@ -255,7 +278,7 @@ static value q_to_caml(const K q_val) {
     return (mk_caml_byte_array(tag_for_vector(q_type), q_val));
   }
   case (-t_int16): {
-    return mk_caml_scalar_array(tag_for_vector(q_type), BIGARRAY_UINT16, kH(q_val), q_val); 
+    return mk_caml_scalar_array(tag_for_vector(q_type), BIGARRAY_UINT16, sizeof(H), kH(q_val), q_val); 
   }
   case (-t_int32):
   case (-t_month): 
@@ -264,17 +287,17 @@ static value q_to_caml(const K q_val) {
   case (-t_second):
   case (-t_time): 
   {
-    return mk_caml_scalar_array(tag_for_vector(q_type), BIGARRAY_INT32, kI(q_val), q_val); 
+    return mk_caml_scalar_array(tag_for_vector(q_type), BIGARRAY_INT32, sizeof(I), kI(q_val), q_val); 
   }
   case (-t_int64):  {
-    return mk_caml_scalar_array(tag_for_vector(q_type), BIGARRAY_INT64, kJ(q_val), q_val); 
+    return mk_caml_scalar_array(tag_for_vector(q_type), BIGARRAY_INT64, sizeof(J), kJ(q_val), q_val); 
   }
   case (-t_float32): {
-    return mk_caml_scalar_array(tag_for_vector(q_type), BIGARRAY_FLOAT32, kE(q_val), q_val); 
+    return mk_caml_scalar_array(tag_for_vector(q_type), BIGARRAY_FLOAT32, sizeof(E), kE(q_val), q_val); 
   }
   case (-t_float64): 
   case (-t_datetime): {
-    return mk_caml_scalar_array(tag_for_vector(q_type), BIGARRAY_FLOAT64, kF(q_val), q_val); 
+    return mk_caml_scalar_array(tag_for_vector(q_type), BIGARRAY_FLOAT64, sizeof(F), kF(q_val), q_val); 
   }
   case (-t_symbol): {
     return mk_caml_string_array(q_val);
@@ -283,6 +306,9 @@ static value q_to_caml(const K q_val) {
   // Mixed lists
 
   case t_mixed_list: {
+    if (is_string_column(q_val)) {
+      return (mk_caml_string_column(q_val));
+    }
     return (mk_caml_value(tag_mixed_list, mk_caml_array(q_val)));;
   }
 
@@ -320,6 +346,46 @@ static value q_to_caml(const K q_val) {
   }
 }
 
+// NULL if q_to_caml can convert q_val, otherwise the reason why not. Lets
+// callers that hold K references check first instead of having q_to_caml
+// raise (and leak the references).
+static const char *unconvertible(const K q_val) {
+  switch (q_val->t) {
+  case t_bool: case t_byte: case t_int16: case t_int32: case t_int64:
+  case t_float32: case t_float64: case t_char: case t_symbol: case t_month:
+  case t_date: case t_datetime: case t_minute: case t_second: case t_time:
+  case -t_bool: case -t_byte: case -t_int16: case -t_int32: case -t_int64:
+  case -t_float32: case -t_float64: case -t_char: case -t_symbol:
+  case -t_month: case -t_date: case -t_datetime: case -t_minute:
+  case -t_second: case -t_time:
+  case t_unit:
+    return NULL;
+  case t_mixed_list: {
+    long i;
+    for (i = 0; i < q_val->n; i++) {
+      const char *error = unconvertible(kK(q_val)[i]);
+      if (NULL != error) {
+        return error;
+      }
+    }
+    return NULL;
+  }
+  case t_table:
+    return unconvertible(q_val->k);
+  case t_dict: {
+    const char *error = unconvertible(kK(q_val)[0]);
+    return (NULL != error) ? error : unconvertible(kK(q_val)[1]);
+  }
+  case t_lambda:      return "Not supported: lambda (type 100)";
+  case t_operator:    return "Not supported: q operator (type 102)";
+  case t_partial_app: return "Not supported: partial application (type 104)";
+  case 12: case -12:  return "Not supported: timestamp (type 12)";
+  case 16: case -16:  return "Not supported: timespan (type 16)";
+  case t_error:       return "Not supported: error (type -128)";
+  default:            return "Not supported: q type";
+  }
+}
+
 ///////////////////////////////////////////////
 // Functions to convert Caml values to K values
 ///////////////////////////////////////////////
@@ -446,16 +512,39 @@ static K mk_symbol_vector(const value v) {
 }
 
 
+// Build a list of char vectors from a Q_v_string. Each row is allocated
+// at its final size and filled with one memcpy.
+static K mk_string_list(const value v) {
+  assert (Is_block(v));
+
+  const long count = check_string_offsets(v, "caml_to_q");
+  const unsigned char *data = Data_bigarray_val(Field(v,0));
+  const int64_t *offs = Data_bigarray_val(Field(v,1));
+  long i;
+
+  K list = ktn(0, count);
+  for (i = 0; i < count; i++) {
+    const long len = offs[i+1] - offs[i];
+    K str = ktn(KC, len);
+    memcpy(kC(str), data + offs[i], len);
+    kK(list)[i] = str;
+  }
+  list->u = (short)Int_val(Field(v,2)); // Attribute
+  return list;
+}
+
+
 static K mk_mixed_list(const value v) {
   assert (Is_block(v));
 
   // TODO: what if the size is more than what fits in an int32?
   // Can you have vectors longer than 2^32 elems in kdb?
   const int count = Wosize_val(v);
-  K list = knk(0);
+  // Allocate the list at its final size rather than growing it with jk
+  K list = ktn(0, count);
   unsigned i;
   for(i=0; i<count; i++) {
-    jk(&list, caml_to_q(Field(v, i)));
+    kK(list)[i] = caml_to_q(Field(v, i));
   }
   return list;
 }
@@ -555,6 +644,9 @@ static K caml_to_q(const value val)
     case tag_v_symbol: {
       return mk_symbol_vector(val);
     }
+    case tag_v_string: {
+      return mk_string_list(val);
+    }
 
     // Mixed lists
 
@@ -598,6 +690,82 @@ CAMLprim value q_connect(value host, value port)
   CAMLreturn(caml_copy_int32(q_instance));
 }
 
+// The kdb+ handshake: send "user:password", the capability byte and a
+// terminating 0, and read back the capability byte accepted by the
+// server. The capability is the one c.o uses for khp, so that the handle
+// can be used with k() like any other. Waits for the reply until deadline
+// (see now_seconds; 0 for no deadline). Returns 0 on success, -2 if the
+// deadline passed and -1 on other errors.
+static int q_handshake(const int fd, const double deadline) {
+  const char *user = getenv("USER");
+  char buf[256];
+  snprintf(buf, sizeof(buf) - 2, "%s", user ? user : "");
+  const int len = strlen(buf);
+  buf[len] = 3;    // capability
+  buf[len + 1] = 0;
+  if (send(fd, buf, len + 2, 0) != len + 2) {
+    return -1;
+  }
+  if (deadline > 0) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (1 != poll_until(&pfd, 1, deadline)) {
+      return -2;
+    }
+  }
+  char cap;
+  return (1 == recv(fd, &cap, 1, 0)) ? 0 : -1;
+}
+
+static int connect_unix_path(const char *path, const int abstract,
+                             const double deadline) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  // In the abstract namespace (Linux) the name starts with a 0 byte
+  strncpy(addr.sun_path + abstract, path, sizeof(addr.sun_path) - 1 - abstract);
+  const socklen_t addr_len =
+    offsetof(struct sockaddr_un, sun_path) + abstract + strlen(path);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (0 != connect(fd, (struct sockaddr *)&addr, addr_len)) {
+    close(fd);
+    return -1;
+  }
+  const int status = q_handshake(fd, deadline);
+  if (0 != status) {
+    close(fd);
+    return status;
+  }
+  return fd;
+}
+
+static int connect_unix(const int port, const double deadline) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/kx.%d", port);
+  int fd = -1;
+#ifdef __linux__
+  fd = connect_unix_path(path, 1, deadline);
+#endif
+  if (-1 == fd) {
+    fd = connect_unix_path(path, 0, deadline);
+  }
+  return fd;
+}
+
+// q -p port also listens on the Unix domain socket /tmp/kx.port (in the
+// abstract namespace on Linux, on the file system elsewhere). Talking to a
+// local instance through it avoids the TCP stack.
+CAMLprim value q_connect_unix(value port)
+{
+  CAMLparam1(port);
+  CAMLreturn(caml_copy_int32(connect_unix(Int_val(port), 0)));
+}
+
 CAMLprim value q_eval_async(value q_conn, value str)
 {
   CAMLparam2(q_conn, str);
@@ -616,6 +784,9 @@ CAMLprim value q_eval(value q_conn, value str)
   assert(Is_block(str));
 
   K reply = k(Int32_val(q_conn), String_val(str), (K)0);
+  if (NULL == reply) {
+    caml_failwith("connection closed");
+  }
   result = q_to_caml(reply);
   // Free the memory for 'reply'
   r0(reply);
@@ -641,6 +812,9 @@ CAMLprim value q_rpc(value q_conn, value str, value val)
   assert(Is_block(str));
 
   K reply = k(Int32_val(q_conn), String_val(str), caml_to_q(val), (K)0);
+  if (NULL == reply) {
+    caml_failwith("connection closed");
+  }
   result = q_to_caml(reply);
   // Free the memory for 'reply'
   r0(reply);
@@ -648,6 +822,1249 @@ CAMLprim value q_rpc(value q_conn, value str, value val)
 }
 
 
+CAMLprim value q_close(value q_conn)
+{
+  CAMLparam1(q_conn);
+  kclose(Int32_val(q_conn));
+  CAMLreturn(Val_unit);
+}
+
+
+///////////////////////////////////////////////////
+// Protected evaluation: the server evaluates x and
+// returns (1b; result) or (0b; error string)
+// instead of signalling the error
+///////////////////////////////////////////////////
+
+#define PROTECTED_EVAL "@[{(1b;value x)};x;{(0b;x)}]"
+
+// Split an (ok; value) pair into its flag and a new reference to the value.
+// Returns -1 if pair is not such a pair. (q collapses (1b;0b) into the bool
+// vector 10b, so that is a pair too.)
+static int result_pair(const K pair, K *val) {
+  if (-t_bool == pair->t && 2 == pair->n) {
+    *val = kb(kG(pair)[1]);
+    return kG(pair)[0];
+  }
+  if (t_mixed_list != pair->t || 2 != pair->n || t_bool != kK(pair)[0]->t) {
+    return -1;
+  }
+  *val = r1(kK(pair)[1]);
+  return kK(pair)[0]->g;
+}
+
+
+///////////////////////////////////////////////////
+// Fan-out queries: the same query sent to several
+// kdb instances at once
+///////////////////////////////////////////////////
+
+// The shards evaluate the query under protected evaluation and send back
+// the (ok; value) pair as an async message. The caller does not block on
+// any one shard: it polls all the handles and reads each reply as soon as
+// it arrives.
+static const char *deferred_query = "{neg[.z.w] " PROTECTED_EVAL "}";
+
+enum shard_state {
+  shard_pending,
+  shard_ok,
+  shard_error,
+  shard_timeout
+};
+
+struct shard {
+  int handle;
+  double deadline;         // absolute, in seconds (see now_seconds)
+  enum shard_state state;
+  K reply;                 // the reply, if any
+  K value;                 // the value (or error) of an (ok; value) reply
+  const char *error;       // for transport errors
+};
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Longest single wait, in seconds. Longer (or infinite) timeouts are
+// waited for in several steps, since poll takes an int of milliseconds.
+#define MAX_WAIT 86400.0
+
+// Milliseconds to pass to poll to wait for (at least) wait seconds, or
+// MAX_WAIT if that is shorter
+static int poll_timeout(const double wait) {
+  if (!(wait > 0)) {
+    return 0;
+  }
+  if (!(wait < MAX_WAIT)) {
+    return (int)(MAX_WAIT * 1000);
+  }
+  return (int)(wait * 1000) + 1;
+}
+
+// poll until some of the fds are ready or the deadline passes. Returns as
+// poll does (0 if the deadline passed).
+static int poll_until(struct pollfd *fds, const int n, const double deadline) {
+  for (;;) {
+    const double wait = deadline - now_seconds();
+    if (wait <= 0) {
+      return 0;
+    }
+    const int ready = poll(fds, n, poll_timeout(wait));
+    if (0 != ready && !(ready < 0 && EINTR == errno)) {
+      return ready;
+    }
+  }
+}
+
+// Bound the blocking reads (opt SO_RCVTIMEO) or writes (SO_SNDTIMEO) of
+// k() on fd to the given number of seconds (0 for no bound)
+static void set_socket_timeout(const int fd, const int opt, double seconds) {
+  struct timeval tv;
+  if (seconds > MAX_WAIT) {
+    seconds = MAX_WAIT;
+  }
+  tv.tv_sec = (time_t)seconds;
+  tv.tv_usec = (suseconds_t)((seconds - tv.tv_sec) * 1e6);
+  setsockopt(fd, SOL_SOCKET, opt, &tv, sizeof(tv));
+}
+
+// Seconds left until deadline, as a socket timeout: at least 1ms, since a
+// zero timeout would mean no bound at all
+static double timeout_until(const double deadline) {
+  const double wait = deadline - now_seconds();
+  return wait > 0.001 ? wait : 0.001;
+}
+
+static void shard_failed(struct shard *s, const char *error) {
+  s->state = shard_error;
+  s->error = error;
+}
+
+// A shard that misses its deadline is shut down, so that its late reply
+// cannot be read as the reply to a later query. The handle stays open
+// (and unusable) until the caller calls q_close on it.
+static void shard_timed_out(struct shard *s) {
+  s->state = shard_timeout;
+  shutdown(s->handle, SHUT_RDWR);
+}
+
+// Read the reply of a shard whose handle poll reported readable. Only the
+// start of the reply may have arrived, and k() reads the rest with blocking
+// reads, so these are bounded by the shard's deadline with SO_RCVTIMEO.
+// Runs without the caml runtime lock.
+static void read_shard_reply(struct shard *s) {
+  set_socket_timeout(s->handle, SO_RCVTIMEO, timeout_until(s->deadline));
+  K reply = k(s->handle, (char *)0);
+  set_socket_timeout(s->handle, SO_RCVTIMEO, 0);
+  if (NULL == reply && now_seconds() >= s->deadline) {
+    shard_timed_out(s);
+  } else if (NULL == reply) {
+    shard_failed(s, "connection closed");
+  } else if (t_error == reply->t) {
+    s->reply = reply;
+    shard_failed(s, (const char *)reply->s);
+  } else {
+    s->reply = reply;
+    const int ok = result_pair(reply, &s->value);
+    if (ok < 0) {
+      shard_failed(s, "unexpected reply");
+    } else {
+      s->state = ok ? shard_ok : shard_error;
+    }
+  }
+}
+
+// Wait for the replies of the pending shards until all have arrived or
+// their deadlines have passed. Other caml threads run meanwhile; they must
+// not use the shards' handles.
+static void wait_for_shards(struct shard *shards, const int n) {
+  int i, pending = 0;
+
+  for (i = 0; i < n; i++) {
+    if (shard_pending == shards[i].state) {
+      pending++;
+    }
+  }
+
+  struct pollfd *fds = calloc(n > 0 ? n : 1, sizeof(struct pollfd));
+  int *which = calloc(n > 0 ? n : 1, sizeof(int));
+  if (NULL == fds || NULL == which) {
+    free(fds);
+    free(which);
+    caml_raise_out_of_memory();
+  }
+
+  // From here on no caml values are touched
+  caml_enter_blocking_section();
+  while (pending > 0) {
+    const double now = now_seconds();
+    double wait = -1;
+    int m = 0;
+    for (i = 0; i < n; i++) {
+      if (shard_pending != shards[i].state) {
+        continue;
+      }
+      if (shards[i].deadline <= now) {
+        shard_timed_out(&shards[i]);
+        pending--;
+        continue;
+      }
+      if (wait < 0 || shards[i].deadline - now < wait) {
+        wait = shards[i].deadline - now;
+      }
+      fds[m].fd = shards[i].handle;
+      fds[m].events = POLLIN;
+      fds[m].revents = 0;
+      which[m++] = i;
+    }
+    if (0 == m) {
+      break;
+    }
+
+    const int ready = poll(fds, m, poll_timeout(wait));
+    if (ready < 0 && EINTR != errno) {
+      for (i = 0; i < m; i++) {
+        shard_failed(&shards[which[i]], "poll failed");
+      }
+      break;
+    }
+    for (i = 0; ready > 0 && i < m; i++) {
+      if (fds[i].revents) {
+        read_shard_reply(&shards[which[i]]);
+        pending--;
+      }
+    }
+  }
+  caml_leave_blocking_section();
+  free(fds);
+  free(which);
+}
+
+// Send the query to every shard, then wait for the replies. Sends are
+// bounded by the shards' deadlines with SO_SNDTIMEO; a shard whose send
+// times out may have got part of the message, so it is shut down.
+static void fanout_collect(struct shard *shards, const int n, const char *str) {
+  int i;
+
+  // The caml string may move while the runtime lock is released
+  char *query = strdup(str);
+  if (NULL == query) {
+    free(shards);
+    caml_raise_out_of_memory();
+  }
+  caml_enter_blocking_section();
+  for (i = 0; i < n; i++) {
+    struct shard *s = &shards[i];
+    set_socket_timeout(s->handle, SO_SNDTIMEO, timeout_until(s->deadline));
+    errno = 0;
+    if (NULL == k(-s->handle, deferred_query, kp((S)query), (K)0)) {
+      if (EAGAIN == errno || EWOULDBLOCK == errno) {
+        shard_timed_out(s);
+      } else {
+        shard_failed(s, "send failed");
+      }
+    }
+    set_socket_timeout(s->handle, SO_SNDTIMEO, 0);
+  }
+  caml_leave_blocking_section();
+  free(query);
+  wait_for_shards(shards, n);
+}
+
+static struct shard *init_shards(value q_conns, value timeouts) {
+  const int n = Wosize_val(q_conns);
+  // A float array is a flat block of doubles
+  if (Wosize_val(timeouts) * sizeof(value) != n * sizeof(double)) {
+    caml_invalid_argument("q_fanout: one timeout per connection expected");
+  }
+
+  struct shard *shards = calloc(n > 0 ? n : 1, sizeof(struct shard));
+  if (NULL == shards) {
+    caml_raise_out_of_memory();
+  }
+  const double now = now_seconds();
+  int i;
+  for (i = 0; i < n; i++) {
+    shards[i].handle = Int32_val(Field(q_conns, i));
+    shards[i].deadline = now + Double_field(timeouts, i);
+    shards[i].state = shard_pending;
+  }
+  return shards;
+}
+
+static void free_shards_replies(struct shard *shards, const int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (NULL != shards[i].value) {
+      r0(shards[i].value);
+    }
+    if (NULL != shards[i].reply) {
+      r0(shards[i].reply);
+    }
+  }
+}
+
+static void free_shards(struct shard *shards, const int n) {
+  free_shards_replies(shards, n);
+  free(shards);
+}
+
+static value mk_caml_error_string(const K str) {
+  CAMLparam0 ();
+  CAMLlocal1 (result);
+
+  if (-t_char == str->t) {
+    result = caml_alloc_string(str->n);
+    memcpy((char *)String_val(result), kC(str), str->n);
+  } else if (t_symbol == str->t) {
+    result = caml_copy_string((const char *)str->s);
+  } else {
+    result = caml_copy_string("error");
+  }
+  CAMLreturn (result);
+}
+
+// Shard_ok | Shard_error of string | Shard_timeout
+static value mk_caml_shard_statuses(const struct shard *shards, const int n) {
+  CAMLparam0 ();
+  CAMLlocal2 (result, v);
+
+  if (0 == n) {
+    CAMLreturn (Atom(0));
+  }
+  result = caml_alloc(n, 0);
+  int i;
+  for (i = 0; i < n; i++) {
+    switch (shards[i].state) {
+    case shard_ok:      v = Val_int(0); break;
+    case shard_timeout: v = Val_int(1); break;
+    default: {
+      if (NULL != shards[i].error) {
+        v = mk_caml_value(0, caml_copy_string(shards[i].error));
+      } else {
+        v = mk_caml_value(0, mk_caml_error_string(shards[i].value));
+      }
+    }
+    }
+    caml_modify(&Field(result, i), v);
+  }
+  CAMLreturn (result);
+}
+
+
+// Size in bytes of the elements of a simple list of type ty (> 0), or 0 if
+// the type is not supported
+static int q_elem_size(const int ty) {
+  switch (ty) {
+  case -t_bool: case -t_byte: case -t_char:
+    return 1;
+  case -t_int16:
+    return 2;
+  case -t_int32: case -t_float32: case -t_month: case -t_date:
+  case -t_minute: case -t_second: case -t_time:
+    return 4;
+  case -t_int64: case -t_float64: case -t_datetime:
+    return 8;
+  case -t_symbol:
+    return sizeof(S);
+  default:
+    return 0;
+  }
+}
+
+static K table_colnames(const K tbl) { return kK(tbl->k)[0]; }
+static K table_cols(const K tbl)     { return kK(tbl->k)[1]; }
+
+// Check that tbl has the column names and column types of first
+static int same_schema(const K first, const K tbl) {
+  const K names0 = table_colnames(first), names = table_colnames(tbl);
+  const K cols0 = table_cols(first), cols = table_cols(tbl);
+  if (names0->n != names->n) {
+    return 0;
+  }
+  long i;
+  for (i = 0; i < names0->n; i++) {
+    if (0 != strcmp((char *)kS(names0)[i], (char *)kS(names)[i]) ||
+        kK(cols0)[i]->t != kK(cols)[i]->t) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Compare element i of column a with element j of column b (same type)
+static int compare_elems(const K a, const long i, const K b, const long j) {
+  switch (a->t) {
+  case -t_bool: case -t_byte: case -t_char:
+    return (kG(a)[i] > kG(b)[j]) - (kG(a)[i] < kG(b)[j]);
+  case -t_int16:
+    return (kH(a)[i] > kH(b)[j]) - (kH(a)[i] < kH(b)[j]);
+  case -t_int32: case -t_month: case -t_date:
+  case -t_minute: case -t_second: case -t_time:
+    return (kI(a)[i] > kI(b)[j]) - (kI(a)[i] < kI(b)[j]);
+  case -t_int64:
+    return (kJ(a)[i] > kJ(b)[j]) - (kJ(a)[i] < kJ(b)[j]);
+  case -t_float32:
+    return (kE(a)[i] > kE(b)[j]) - (kE(a)[i] < kE(b)[j]);
+  case -t_float64: case -t_datetime:
+    return (kF(a)[i] > kF(b)[j]) - (kF(a)[i] < kF(b)[j]);
+  case -t_symbol:
+    return strcmp((char *)kS(a)[i], (char *)kS(b)[j]);
+  default:
+    assert(0);
+    return 0;
+  }
+}
+
+// Cursor of the k-way merge: the next row of table 'src'
+struct merge_cursor {
+  int src;
+  long row;
+};
+
+static int cursor_less(const K *keys, const struct merge_cursor *x,
+                       const struct merge_cursor *y) {
+  const int c = compare_elems(keys[x->src], x->row, keys[y->src], y->row);
+  // Ties keep shard order, so the merge is stable
+  return c < 0 || (0 == c && x->src < y->src);
+}
+
+static void heap_sift_down(const K *keys, struct merge_cursor *heap,
+                           const int size, int i) {
+  for (;;) {
+    int least = i;
+    const int l = 2 * i + 1, r = 2 * i + 2;
+    if (l < size && cursor_less(keys, &heap[l], &heap[least])) least = l;
+    if (r < size && cursor_less(keys, &heap[r], &heap[least])) least = r;
+    if (least == i) {
+      return;
+    }
+    const struct merge_cursor tmp = heap[i];
+    heap[i] = heap[least];
+    heap[least] = tmp;
+    i = least;
+  }
+}
+
+// Fill src_of[r], row_of[r] with the table and row that go to row r of the
+// merged result, merging the tables on column key_col (each table must
+// already be sorted on it)
+static void merge_order(const K *tbls, const int n, const int key_col,
+                        int *src_of, long *row_of) {
+  K *keys = malloc(n * sizeof(K));
+  struct merge_cursor *heap = malloc(n * sizeof(struct merge_cursor));
+  if (NULL == keys || NULL == heap) {
+    free(keys);
+    free(heap);
+    caml_raise_out_of_memory();
+  }
+  int i, size = 0;
+  for (i = 0; i < n; i++) {
+    keys[i] = kK(table_cols(tbls[i]))[key_col];
+    if (keys[i]->n > 0) {
+      heap[size].src = i;
+      heap[size].row = 0;
+      size++;
+    }
+  }
+  for (i = size / 2 - 1; i >= 0; i--) {
+    heap_sift_down(keys, heap, size, i);
+  }
+  long r = 0;
+  while (size > 0) {
+    src_of[r] = heap[0].src;
+    row_of[r] = heap[0].row;
+    r++;
+    if (++heap[0].row == keys[heap[0].src]->n) {
+      heap[0] = heap[--size];
+    }
+    heap_sift_down(keys, heap, size, 0);
+  }
+  free(keys);
+  free(heap);
+}
+
+// Bigarray kind of the elements of a simple list of type ty (> 0, not
+// symbols)
+static int q_bigarray_kind(const int ty) {
+  switch (ty) {
+  case -t_bool: case -t_byte: case -t_char:
+    return BIGARRAY_UINT8;
+  case -t_int16:
+    return BIGARRAY_UINT16;
+  case -t_float32:
+    return BIGARRAY_FLOAT32;
+  case -t_int64:
+    return BIGARRAY_INT64;
+  case -t_float64: case -t_datetime:
+    return BIGARRAY_FLOAT64;
+  default:
+    return BIGARRAY_INT32;
+  }
+}
+
+// Column c of the merged table. Simple columns are copied straight into a
+// caml-managed bigarray of the final size; general columns are gathered
+// into a temporary K list (of new references to the rows) and converted.
+static value mk_caml_merged_column(const K *tbls, const int n, const long c,
+                                   const long total, const int *src_of,
+                                   const long *row_of) {
+  CAMLparam0 ();
+  CAMLlocal2 (col, v);
+
+  const int ty = kK(table_cols(tbls[0]))[c]->t;
+  long pos = 0, r;
+  int i;
+
+  if (-t_symbol == ty) {
+    col = (0 == total) ? Atom(0) : caml_alloc(total, 0);
+    if (NULL == src_of) {
+      for (i = 0; i < n; i++) {
+        const K part = kK(table_cols(tbls[i]))[c];
+        for (r = 0; r < part->n; r++) {
+          v = caml_copy_string((char *)kS(part)[r]);
+          caml_modify(&Field(col, pos++), v);
+        }
+      }
+    } else {
+      for (r = 0; r < total; r++) {
+        const K part = kK(table_cols(tbls[src_of[r]]))[c];
+        v = caml_copy_string((char *)kS(part)[row_of[r]]);
+        caml_modify(&Field(col, r), v);
+      }
+    }
+    CAMLreturn (mk_caml_value_two(tag_v_symbol, col, Val_int(0)));
+  }
+
+  if (t_mixed_list == ty) {
+    K list = ktn(0, total);
+    if (NULL == src_of) {
+      for (i = 0; i < n; i++) {
+        const K part = kK(table_cols(tbls[i]))[c];
+        for (r = 0; r < part->n; r++) {
+          kK(list)[pos++] = r1(kK(part)[r]);
+        }
+      }
+    } else {
+      for (r = 0; r < total; r++) {
+        const K part = kK(table_cols(tbls[src_of[r]]))[c];
+        kK(list)[r] = r1(kK(part)[row_of[r]]);
+      }
+    }
+    // Cannot raise: the shards' tables were checked with unconvertible
+    col = q_to_caml(list);
+    r0(list);
+    CAMLreturn (col);
+  }
+
+  const int size = q_elem_size(ty);
+  long dims[1];
+  dims[0] = total;
+  col = alloc_bigarray(q_bigarray_kind(ty) | BIGARRAY_C_LAYOUT, 1, NULL, dims);
+  unsigned char *data = Data_bigarray_val(col);
+  if (NULL == src_of) {
+    for (i = 0; i < n; i++) {
+      const K part = kK(table_cols(tbls[i]))[c];
+      memcpy(data + pos * size, kG(part), part->n * size);
+      pos += part->n;
+    }
+  } else {
+    for (r = 0; r < total; r++) {
+      const K part = kK(table_cols(tbls[src_of[r]]))[c];
+      memcpy(data + r * size, kG(part) + row_of[r] * size, size);
+    }
+  }
+  CAMLreturn (mk_caml_value_two(tag_for_vector(ty), col, Val_int(0)));
+}
+
+// Merge same-schema tables into one Q_table. Each column of the result is
+// allocated once at its final size. If key_col >= 0 the rows are merged in
+// order of that column; otherwise the tables are concatenated.
+static value mk_caml_merged_table(const K *tbls, const int n, const int key_col) {
+  CAMLparam0 ();
+  CAMLlocal3 (tbl, cols, v);
+
+  const K names = table_colnames(tbls[0]);
+  const long n_cols = names->n;
+  long total = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    total += kK(table_cols(tbls[i]))[0]->n;
+  }
+
+  int *src_of = NULL;
+  long *row_of = NULL;
+  if (key_col >= 0) {
+    src_of = malloc((total > 0 ? total : 1) * sizeof(int));
+    row_of = malloc((total > 0 ? total : 1) * sizeof(long));
+    if (NULL == src_of || NULL == row_of) {
+      free(src_of);
+      free(row_of);
+      caml_raise_out_of_memory();
+    }
+    merge_order(tbls, n, key_col, src_of, row_of);
+  }
+
+  cols = caml_alloc(n_cols, 0);
+  long c;
+  for (c = 0; c < n_cols; c++) {
+    v = mk_caml_merged_column(tbls, n, c, total, src_of, row_of);
+    caml_modify(&Field(cols, c), v);
+  }
+  free(src_of);
+  free(row_of);
+
+  tbl = caml_alloc(3, 0);
+  Store_field(tbl, 0, mk_caml_string_array(names));
+  Store_field(tbl, 1, mk_caml_value(tag_mixed_list, cols));
+  Store_field(tbl, 2, Val_int(0)); // Attribute
+  CAMLreturn (mk_caml_value(tag_table, tbl));
+}
+
+CAMLprim value q_fanout(value q_conns, value timeouts, value str)
+{
+  CAMLparam3(q_conns, timeouts, str);
+  CAMLlocal3(vals, statuses, v);
+
+  const int n = Wosize_val(q_conns);
+  struct shard *shards = init_shards(q_conns, timeouts);
+  fanout_collect(shards, n, String_val(str));
+
+  vals = (0 == n) ? Atom(0) : caml_alloc(n, 0);
+  int i;
+  for (i = 0; i < n; i++) {
+    const char *error = (shard_ok == shards[i].state)
+      ? unconvertible(shards[i].value) : NULL;
+    if (NULL != error) {
+      shard_failed(&shards[i], error);
+    }
+    if (shard_ok == shards[i].state) {
+      v = q_to_caml(shards[i].value);
+    } else {
+      v = Val_int(tag_unit);
+    }
+    caml_modify(&Field(vals, i), v);
+  }
+  statuses = mk_caml_shard_statuses(shards, n);
+  free_shards(shards, n);
+  CAMLreturn(mk_caml_pair(vals, statuses));
+}
+
+// Merge the values of the shards that succeeded into one Q_table, or unit
+// if there is none. Values that are not tables or whose schema differs
+// from the first table fail their shard. On errors, frees the shards and
+// fails with a message that starts with caller.
+static value merge_shards(struct shard *shards, const int n, value sort_col,
+                          const char *caller) {
+  CAMLparam1 (sort_col);
+  CAMLlocal1 (result);
+  char msg[256];
+
+  // The tables to merge: values of the shards that succeeded and agree
+  // with the schema of the first one
+  K *tbls = malloc((n > 0 ? n : 1) * sizeof(K));
+  if (NULL == tbls) {
+    free_shards(shards, n);
+    caml_raise_out_of_memory();
+  }
+  int i, n_tbls = 0;
+  for (i = 0; i < n; i++) {
+    if (shard_ok != shards[i].state) {
+      continue;
+    }
+    const K tbl = shards[i].value;
+    if (t_table != tbl->t) {
+      shard_failed(&shards[i], "not a table");
+    } else if (n_tbls > 0 && !same_schema(tbls[0], tbl)) {
+      shard_failed(&shards[i], "schema mismatch");
+    } else if (0 == table_colnames(tbl)->n) {
+      shard_failed(&shards[i], "table has no columns");
+    } else if (NULL != unconvertible(tbl)) {
+      shard_failed(&shards[i], unconvertible(tbl));
+    } else {
+      tbls[n_tbls++] = tbl;
+    }
+  }
+
+  if (n_tbls > 0) {
+    const K cols = table_cols(tbls[0]);
+    for (i = 0; i < cols->n; i++) {
+      if (t_mixed_list != kK(cols)[i]->t && 0 == q_elem_size(kK(cols)[i]->t)) {
+        free(tbls);
+        free_shards(shards, n);
+        snprintf(msg, sizeof(msg), "%s: unsupported column type", caller);
+        caml_failwith(msg);
+      }
+    }
+  }
+
+  int key_col = -1;
+  if (n_tbls > 0 && caml_string_length(sort_col) > 0) {
+    const K names = table_colnames(tbls[0]);
+    for (i = 0; i < names->n; i++) {
+      if (0 == strcmp((char *)kS(names)[i], String_val(sort_col))) {
+        key_col = i;
+      }
+    }
+    if (key_col < 0 || 0 == q_elem_size(kK(table_cols(tbls[0]))[key_col]->t)) {
+      free(tbls);
+      free_shards(shards, n);
+      snprintf(msg, sizeof(msg), "%s: no sortable column with that name", caller);
+      caml_failwith(msg);
+    }
+  }
+
+  if (0 == n_tbls) {
+    result = Val_int(tag_unit);
+  } else {
+    result = mk_caml_merged_table(tbls, n_tbls, key_col);
+  }
+  free(tbls);
+  CAMLreturn (result);
+}
+
+CAMLprim value q_fanout_merge(value q_conns, value timeouts, value str,
+                              value sort_col)
+{
+  CAMLparam4(q_conns, timeouts, str, sort_col);
+  CAMLlocal2(result, statuses);
+
+  const int n = Wosize_val(q_conns);
+  struct shard *shards = init_shards(q_conns, timeouts);
+  fanout_collect(shards, n, String_val(str));
+  result = merge_shards(shards, n, sort_col, "q_fanout_merge");
+  statuses = mk_caml_shard_statuses(shards, n);
+  free_shards(shards, n);
+  CAMLreturn(mk_caml_pair(result, statuses));
+}
+
+// Merge tables given as q_vals, as q_fanout_merge merges the replies of
+// its shards. A table that cannot be merged fails the whole call.
+CAMLprim value q_merge_tables(value tables, value sort_col)
+{
+  CAMLparam2(tables, sort_col);
+  CAMLlocal1(result);
+  char msg[256];
+
+  const int n = Wosize_val(tables);
+  struct shard *shards = calloc(n > 0 ? n : 1, sizeof(struct shard));
+  if (NULL == shards) {
+    caml_raise_out_of_memory();
+  }
+  int i;
+  for (i = 0; i < n; i++) {
+    shards[i].state = shard_ok;
+    shards[i].value = caml_to_q(Field(tables, i));
+  }
+  result = merge_shards(shards, n, sort_col, "q_merge_tables");
+  for (i = 0; i < n; i++) {
+    if (shard_ok != shards[i].state) {
+      snprintf(msg, sizeof(msg), "q_merge_tables: table %d: %s", i, shards[i].error);
+      free_shards(shards, n);
+      caml_failwith(msg);
+    }
+  }
+  free_shards(shards, n);
+  CAMLreturn(result);
+}
+
+///////////////////////////////////////////////////
+// Lazy views over K values: the reply is kept as
+// is and only the parts that are looked at are
+// converted to caml values
+///////////////////////////////////////////////////
+
+#define K_val(v) (*((K *) Data_custom_val(v)))
+
+static void q_view_finalize(value v) {
+  if (NULL != K_val(v)) {
+    r0(K_val(v));
+  }
+}
+
+static struct custom_operations q_view_ops = {
+  "q_view",
+  q_view_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+// Wrap x (whose reference the view takes over) in a custom block
+static value mk_view(const K x) {
+  CAMLparam0 ();
+  CAMLlocal1 (v);
+
+  // Views may hold large replies: ask for a major slice every 1000 views
+  v = caml_alloc_custom(&q_view_ops, sizeof(K), 1, 1000);
+  K_val(v) = x;
+  CAMLreturn (v);
+}
+
+// Take over a reply of k(): raise on errors, otherwise wrap it
+static value mk_reply_view(const K reply) {
+  char msg[256];
+
+  if (NULL == reply) {
+    caml_failwith("connection closed");
+  }
+  if (t_error == reply->t) {
+    snprintf(msg, sizeof(msg), "%s", reply->s);
+    r0(reply);
+    caml_failwith(msg);
+  }
+  return mk_view(reply);
+}
+
+// Element i of a simple list as an atom
+static K vector_elem(const K x, const long i) {
+  K atom;
+  switch (x->t) {
+  case -t_bool: case -t_byte: case -t_char:
+    atom = ka(-x->t); atom->g = kG(x)[i]; return atom;
+  case -t_int16:
+    atom = ka(-x->t); atom->h = kH(x)[i]; return atom;
+  case -t_int32: case -t_month: case -t_date:
+  case -t_minute: case -t_second: case -t_time:
+    atom = ka(-x->t); atom->i = kI(x)[i]; return atom;
+  case -t_int64:
+    atom = ka(-x->t); atom->j = kJ(x)[i]; return atom;
+  case -t_float32:
+    atom = ka(-x->t); atom->e = kE(x)[i]; return atom;
+  case -t_float64: case -t_datetime:
+    atom = ka(-x->t); atom->f = kF(x)[i]; return atom;
+  case -t_symbol:
+    return ks(kS(x)[i]);
+  default:
+    caml_failwith("q_view: cannot index a value of this type");
+  }
+}
+
+// Element i of any list, with a new reference
+static K list_elem(const K x, const long i) {
+  if (i < 0 || i >= x->n) {
+    caml_invalid_argument("q_view: index out of bounds");
+  }
+  return (t_mixed_list == x->t) ? r1(kK(x)[i]) : vector_elem(x, i);
+}
+
+static long symbol_index(const K syms, const char *name) {
+  long i;
+  for (i = 0; i < syms->n; i++) {
+    if (0 == strcmp((char *)kS(syms)[i], name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Column called name of table x, with a new reference, or NULL
+static K table_column(const K x, const char *name) {
+  const long i = symbol_index(kK(x->k)[0], name);
+  return (i < 0) ? NULL : r1(kK(kK(x->k)[1])[i]);
+}
+
+static long count(const K x) {
+  if (x->t < 0 || x->t >= t_lambda) {
+    return 1;
+  }
+  if (t_table == x->t) {
+    const K cols = kK(x->k)[1];
+    return (0 == cols->n) ? 0 : count(kK(cols)[0]);
+  }
+  if (t_dict == x->t) {
+    return count(kK(x)[0]);
+  }
+  return x->n;
+}
+
+CAMLprim value q_eval_view(value q_conn, value str)
+{
+  CAMLparam2(q_conn, str);
+
+  assert(Is_block(str));
+
+  K reply = k(Int32_val(q_conn), String_val(str), (K)0);
+  CAMLreturn(mk_reply_view(reply));
+}
+
+CAMLprim value q_rpc_view(value q_conn, value str, value val)
+{
+  CAMLparam3(q_conn, str, val);
+
+  assert(Is_block(str));
+
+  K reply = k(Int32_val(q_conn), String_val(str), caml_to_q(val), (K)0);
+  CAMLreturn(mk_reply_view(reply));
+}
+
+// A view over a q_val in its kdb form, as q_rpc would send it
+CAMLprim value q_view_of_val(value val)
+{
+  CAMLparam1(val);
+  CAMLreturn(mk_view(caml_to_q(val)));
+}
+
+CAMLprim value q_view_type(value view)
+{
+  CAMLparam1(view);
+  CAMLreturn(Val_int(K_val(view)->t));
+}
+
+CAMLprim value q_view_count(value view)
+{
+  CAMLparam1(view);
+  CAMLreturn(Val_long(count(K_val(view))));
+}
+
+CAMLprim value q_view_index(value view, value i)
+{
+  CAMLparam2(view, i);
+
+  const K x = K_val(view);
+  if (x->t < 0 || x->t >= t_table) {
+    caml_failwith("q_view_index: not a list");
+  }
+  CAMLreturn(mk_view(list_elem(x, Long_val(i))));
+}
+
+// Column of a table, or of the key or value table of a keyed table
+CAMLprim value q_view_column(value view, value name)
+{
+  CAMLparam2(view, name);
+
+  const K x = K_val(view);
+  K col = NULL;
+  if (t_table == x->t) {
+    col = table_column(x, String_val(name));
+  } else if (t_dict == x->t && t_table == kK(x)[0]->t && t_table == kK(x)[1]->t) {
+    col = table_column(kK(x)[0], String_val(name));
+    if (NULL == col) {
+      col = table_column(kK(x)[1], String_val(name));
+    }
+  } else {
+    caml_failwith("q_view_column: not a table");
+  }
+  if (NULL == col) {
+    caml_raise_not_found();
+  }
+  CAMLreturn(mk_view(col));
+}
+
+// Value for a symbol key of a dictionary
+CAMLprim value q_view_find(value view, value key)
+{
+  CAMLparam2(view, key);
+
+  const K x = K_val(view);
+  if (t_dict != x->t || -t_symbol != kK(x)[0]->t) {
+    caml_failwith("q_view_find: not a dictionary with symbol keys");
+  }
+  const long i = symbol_index(kK(x)[0], String_val(key));
+  if (i < 0) {
+    caml_raise_not_found();
+  }
+  const K vals = kK(x)[1];
+  if (vals->t < 0 || vals->t >= t_table) {
+    caml_failwith("q_view_find: dictionary values are not a list");
+  }
+  CAMLreturn(mk_view(list_elem(vals, i)));
+}
+
+CAMLprim value q_view_keys(value view)
+{
+  CAMLparam1(view);
+
+  const K x = K_val(view);
+  if (t_dict != x->t) {
+    caml_failwith("q_view_keys: not a dictionary");
+  }
+  CAMLreturn(mk_view(r1(kK(x)[0])));
+}
+
+CAMLprim value q_view_values(value view)
+{
+  CAMLparam1(view);
+
+  const K x = K_val(view);
+  if (t_dict != x->t) {
+    caml_failwith("q_view_values: not a dictionary");
+  }
+  CAMLreturn(mk_view(r1(kK(x)[1])));
+}
+
+// The vectors of the result are copies (see mk_caml_scalar_array), so they
+// outlive the view's K
+CAMLprim value q_view_to_caml(value view)
+{
+  CAMLparam1(view);
+  CAMLreturn(q_to_caml(K_val(view)));
+}
+
+///////////////////////////////////////////////////
+// Batches: several independent queries in one
+// round trip
+///////////////////////////////////////////////////
+
+// Each item is evaluated on its own, so a failing item does not fail the
+// batch
+static const char *batch_query = "{{" PROTECTED_EVAL "} each x}";
+
+// Send the items (a mixed list, one element per query) and convert the
+// reply into an array of Q_ok value | Q_error message
+static value run_batch(const int handle, const K items) {
+  CAMLparam0 ();
+  CAMLlocal2 (result, v);
+  char msg[256];
+
+  // Allocate the result first, so that no allocation failure can leak
+  // the reply
+  const long n = items->n;
+  result = caml_alloc(n, 0);
+  K reply = k(handle, batch_query, items, (K)0);
+  if (NULL == reply) {
+    caml_failwith("connection closed");
+  }
+  if (t_error == reply->t) {
+    snprintf(msg, sizeof(msg), "%s", reply->s);
+    r0(reply);
+    caml_failwith(msg);
+  }
+  if (t_mixed_list != reply->t || n != reply->n) {
+    r0(reply);
+    caml_failwith("q_batch: unexpected reply");
+  }
+
+  long i;
+  for (i = 0; i < n; i++) {
+    K val;
+    const int ok = result_pair(kK(reply)[i], &val);
+    if (ok < 0) {
+      r0(reply);
+      caml_failwith("q_batch: unexpected reply");
+    }
+    // An item that q_to_caml cannot convert (a lambda, a timestamp, ...)
+    // is an error of that item only; q_to_caml would raise and leak val
+    // and the reply
+    const char *error = ok ? unconvertible(val) : NULL;
+    if (ok && NULL == error) {
+      v = mk_caml_value(0, q_to_caml(val));               // Q_ok
+    } else if (ok) {
+      v = mk_caml_value(1, caml_copy_string(error));      // Q_error
+    } else {
+      v = mk_caml_value(1, mk_caml_error_string(val));    // Q_error
+    }
+    r0(val);
+    caml_modify(&Field(result, i), v);
+  }
+  r0(reply);
+  CAMLreturn (result);
+}
+
+CAMLprim value q_eval_batch(value q_conn, value strs)
+{
+  CAMLparam2(q_conn, strs);
+
+  const long n = Wosize_val(strs);
+  if (0 == n) {
+    CAMLreturn(Atom(0));
+  }
+  K items = ktn(0, n);
+  long i;
+  for (i = 0; i < n; i++) {
+    kK(items)[i] = kp((S)String_val(Field(strs, i)));
+  }
+  CAMLreturn(run_batch(Int32_val(q_conn), items));
+}
+
+// Each call (f, arg) is evaluated as ("f"; arg), as q_rpc does
+CAMLprim value q_rpc_batch(value q_conn, value calls)
+{
+  CAMLparam2(q_conn, calls);
+
+  const long n = Wosize_val(calls);
+  if (0 == n) {
+    CAMLreturn(Atom(0));
+  }
+  K items = ktn(0, n);
+  long i;
+  for (i = 0; i < n; i++) {
+    const value call = Field(calls, i);
+    kK(items)[i] = knk(2, kp((S)String_val(Field(call, 0))),
+                       caml_to_q(Field(call, 1)));
+  }
+  CAMLreturn(run_batch(Int32_val(q_conn), items));
+}
+
+///////////////////////////////////////////////////
+// Deadlines: connections and queries that give up
+// instead of blocking forever
+///////////////////////////////////////////////////
+
+// Connect a TCP socket without blocking for longer than timeout seconds.
+// Returns the socket, -2 if the timeout passed, or -1.
+// The host name is resolved before the clock starts: getaddrinfo cannot be
+// interrupted, so the timeout does not bound name resolution (use an
+// address, or a local resolver cache, where that matters).
+static int connect_tcp(const char *host, const int port, const double timeout) {
+  struct addrinfo hints, *addrs, *a;
+  char service[16];
+  int fd = -1, timed_out = 0;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%d", port);
+  if (0 != getaddrinfo(host, service, &hints, &addrs)) {
+    return -1;
+  }
+  const double deadline = now_seconds() + timeout;
+  for (a = addrs; NULL != a && fd < 0; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    const int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int ok = (0 == connect(fd, a->ai_addr, a->ai_addrlen));
+    if (!ok && EINPROGRESS == errno) {
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      if (1 == poll_until(&pfd, 1, deadline)) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        ok = (0 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) && 0 == err);
+      } else {
+        timed_out = 1;
+      }
+    }
+    if (!ok) {
+      close(fd);
+      fd = -1;
+      continue;
+    }
+    // Back to blocking mode, which is what k() expects
+    fcntl(fd, F_SETFL, flags);
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  freeaddrinfo(addrs);
+  if (fd < 0) {
+    return timed_out ? -2 : -1;
+  }
+
+  const int status = q_handshake(fd, deadline);
+  if (0 != status) {
+    close(fd);
+    return status;
+  }
+  return fd;
+}
+
+// Like q_connect, with a timeout in seconds for the connection and the
+// handshake (not for resolving the host name, see connect_tcp). Returns -2
+// on timeouts and -1 on other errors.
+CAMLprim value q_connect_timeout(value host, value port, value timeout)
+{
+  CAMLparam3(host, port, timeout);
+
+  int q_instance;
+  if (0 == strcmp(String_val(host), "unix://")) {
+    q_instance = connect_unix(Int_val(port), now_seconds() + Double_val(timeout));
+  } else {
+    q_instance = connect_tcp(String_val(host), Int_val(port), Double_val(timeout));
+  }
+  CAMLreturn(caml_copy_int32(q_instance));
+}
+
+// Evaluate str (applied to arg, which is consumed, unless NULL) with a sync
+// k() call, as q_eval and q_rpc do. Its writes and reads are bounded by
+// SO_SNDTIMEO and SO_RCVTIMEO set to the timeout: each of them, not their
+// total, so a reply that keeps trickling in can take longer. The call runs
+// without the caml runtime lock; other caml threads must not use handle
+// meanwhile.
+static value eval_with_timeout(const int handle, const double timeout,
+                               const char *str, K arg) {
+  CAMLparam0 ();
+  CAMLlocal1 (result);
+  char error[256];
+
+  // The caml string may move while the runtime lock is released
+  char *query = strdup(str);
+  if (NULL == query) {
+    if (NULL != arg) {
+      r0(arg);
+    }
+    caml_raise_out_of_memory();
+  }
+  const double deadline = now_seconds() + timeout;
+  set_socket_timeout(handle, SO_SNDTIMEO, timeout_until(deadline));
+  set_socket_timeout(handle, SO_RCVTIMEO, timeout_until(deadline));
+  caml_enter_blocking_section();
+  errno = 0;
+  K reply = (NULL == arg) ? k(handle, query, (K)0) : k(handle, query, arg, (K)0);
+  const int err = errno;
+  caml_leave_blocking_section();
+  set_socket_timeout(handle, SO_SNDTIMEO, 0);
+  set_socket_timeout(handle, SO_RCVTIMEO, 0);
+  free(query);
+
+  if (NULL == reply) {
+    if (EAGAIN == err || EWOULDBLOCK == err || now_seconds() >= deadline) {
+      // A late reply would be read as the reply to the next query
+      shutdown(handle, SHUT_RDWR);
+      // Q_timeout is registered by q.ml
+      caml_raise_with_string(*caml_named_value("Q_timeout"),
+                             "query timed out; the connection has been shut down");
+    }
+    caml_failwith("connection closed");
+  }
+  if (t_error == reply->t) {
+    snprintf(error, sizeof(error), "%s", reply->s);
+    r0(reply);
+    caml_failwith(error);
+  }
+  if (NULL != unconvertible(reply)) {
+    snprintf(error, sizeof(error), "%s", unconvertible(reply));
+    r0(reply);
+    caml_failwith(error);
+  }
+  result = q_to_caml(reply);
+  r0(reply);
+  CAMLreturn (result);
+}
+
+CAMLprim value q_eval_timeout(value q_conn, value timeout, value str)
+{
+  CAMLparam3(q_conn, timeout, str);
+
+  assert(Is_block(str));
+
+  CAMLreturn(eval_with_timeout(Int32_val(q_conn), Double_val(timeout),
+                               String_val(str), NULL));
+}
+
+CAMLprim value q_rpc_timeout(value q_conn, value timeout, value str, value val)
+{
+  CAMLparam4(q_conn, timeout, str, val);
+
+  assert(Is_block(str));
+
+  CAMLreturn(eval_with_timeout(Int32_val(q_conn), Double_val(timeout),
+                               String_val(str), caml_to_q(val)));
+}
+
+// Monotonic clock, in seconds, for latency measurements
+CAMLprim value q_clock(value unit)
+{
+  CAMLparam1(unit);
+  CAMLreturn(caml_copy_double(now_seconds()));
+}
+
 /**
 
 Q values in caml (using the array interface)
@@ -77,6 +77,7 @@ enum caml_tags {
   tag_v_minute, 
   tag_v_second,
   tag_v_time,
+  tag_v_string,
   // mixed lists
   tag_mixed_list,  
   // tables and dictionaries
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_journal.c
+ */
+
+// Replay of tickerplant log files (journals) without a q process.
+//
+// A journal is a q list file: an 8-byte header (0xff 0x01, then the type,
+// attribute and count of a mixed list) followed by one serialised object
+// per logged message, typically (`upd; `table; data). The file is mapped
+// into memory and read sequentially. A tickerplant that died mid-write
+// leaves a truncated last message, which is detected and skipped.
+
+// Uncomment next line to disable assertions
+// #define NDEBUG
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/callback.h>
+#include <caml/fail.h>
+#include "q_interface.h"
+#include "q_caml.h"
+#include "q_serial.h"
+
+#define JOURNAL_HEADER_SIZE 8
+
+typedef unsigned char byte;
+
+CAMLprim value q_journal_open(value path)
+{
+  CAMLparam1(path);
+  CAMLlocal1(result);
+
+  result = q_map_file(String_val(path), "q_journal_open");
+  const byte *base = Mapping_val(result)->base;
+  const size_t len = Mapping_val(result)->len;
+  if (len < JOURNAL_HEADER_SIZE ||
+      0xff != base[0] || 0x01 != base[1] || t_mixed_list != base[2]) {
+    char msg[512];
+    snprintf(msg, sizeof(msg), "q_journal_open: %s: not a journal",
+             String_val(path));
+    caml_failwith(msg);
+  }
+  // Replay reads the file front to back
+  madvise((void *)base, len, MADV_SEQUENTIAL);
+  CAMLreturn(result);
+}
+
+// Number of complete messages, and whether the journal ends with a
+// truncated (or corrupt) message
+CAMLprim value q_journal_validate(value journal)
+{
+  CAMLparam1(journal);
+
+  const byte *p = Mapping_val(journal)->base + JOURNAL_HEADER_SIZE;
+  const byte *end = Mapping_val(journal)->base + Mapping_val(journal)->len;
+  long count = 0;
+  while (p < end) {
+    const long size = q_object_size(p, end);
+    if (size < 0) {
+      break;
+    }
+    p += size;
+    count++;
+  }
+  CAMLreturn(mk_caml_pair(Val_long(count), Val_bool(p < end)));
+}
+
+// If the message at p has the form (`fun; `table; data), return the table
+// name and set *data to the start of data. Otherwise return NULL.
+static const char *message_table(const byte *p, const byte *end,
+                                 const byte **data) {
+  int32_t n;
+  memcpy(&n, p + 2, sizeof(n));
+  if (t_mixed_list != (signed char)p[0] || 3 != n) {
+    return NULL;
+  }
+  const byte *fun = p + 6;
+  if (t_symbol != (signed char)fun[0]) {
+    return NULL;
+  }
+  const byte *table = fun + q_object_size(fun, end);
+  if (t_symbol != (signed char)table[0]) {
+    return NULL;
+  }
+  *data = table + q_object_size(table, end);
+  return (const char *)(table + 1);
+}
+
+static int wanted_table(const char *table, value tables) {
+  const mlsize_t n = Wosize_val(tables);
+  mlsize_t i;
+  if (0 == n) {
+    return 1;
+  }
+  for (i = 0; i < n; i++) {
+    if (0 == strcmp(table, String_val(Field(tables, i)))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Call f table data for every message (`fun; `table; data) with index in
+// [first, last) (last < 0: up to the end) whose table is in tables (all
+// tables if empty). Messages that are filtered out are skipped without
+// being decoded. Wanted messages that cannot be decoded are passed to
+// on_error index reason instead of f. Returns the number of calls to f.
+CAMLprim value q_journal_replay(value journal, value first, value last,
+                                value tables, value f, value on_error)
+{
+  CAMLparam5(journal, first, last, tables, f);
+  CAMLxparam1(on_error);
+  CAMLlocal3(table, data, reason);
+
+  // The mapping does not move, even if the custom block does
+  const byte *p = Mapping_val(journal)->base + JOURNAL_HEADER_SIZE;
+  const byte *end = Mapping_val(journal)->base + Mapping_val(journal)->len;
+  const long lo = Long_val(first), hi = Long_val(last);
+  long index = 0, calls = 0;
+
+  while (p < end && (hi < 0 || index < hi)) {
+    const long size = q_object_size(p, end);
+    if (size < 0) {
+      // truncated tail
+      break;
+    }
+    const byte *q;
+    const char *name, *error;
+    if (index >= lo && NULL != (name = message_table(p, end, &q)) &&
+        wanted_table(name, tables)) {
+      if (NULL != (error = q_object_unconvertible(q, end))) {
+        reason = caml_copy_string(error);
+        caml_callback2(on_error, Val_long(index), reason);
+      } else {
+        // The callback may keep data, so vectors are copied out of the
+        // mapping
+        data = q_decode_object(&q, 1);
+        table = caml_copy_string(name);
+        caml_callback2(f, table, data);
+        calls++;
+      }
+    }
+    p += size;
+    index++;
+  }
+  CAMLreturn(Val_long(calls));
+}
+
+CAMLprim value q_journal_replay_bytecode(value *argv, int argn)
+{
+  return q_journal_replay(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
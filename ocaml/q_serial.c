@@ -0,0 +1,936 @@
+/*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_serial.c
+ */
+
+// Uncomment next line to disable assertions
+// #define NDEBUG
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+#include <caml/bigarray.h>
+#include "q_interface.h"
+#include "q_caml.h"
+#include "q_serial.h"
+
+// Nesting deeper than this is taken to be a corrupt object
+#define MAX_DEPTH 1000
+
+// The type byte of sorted dictionaries (dictionaries with the s attribute)
+#define t_sorted_dict 127
+
+typedef unsigned char byte;
+
+
+///////////////////////////////////////////////
+// Sizes of serialised objects
+///////////////////////////////////////////////
+
+static int32_t read_int32(const byte *p) {
+  int32_t i;
+  memcpy(&i, p, sizeof(i));
+  return i;
+}
+
+// Size of the payload of an atom of type -ty, or of an element of a vector
+// of type ty. 0 for symbols (variable length) and unsupported types.
+static long elem_size(const int ty) {
+  switch (ty) {
+  case KB: case KG: case KC:
+    return 1;
+  case UU:
+    return 16;
+  case KH:
+    return 2;
+  case KI: case KE: case KM: case KD: case KU: case KV: case KT:
+    return 4;
+  case KJ: case KF: case KP: case KZ: case KN:
+    return 8;
+  default:
+    return 0;
+  }
+}
+
+// Size of the 0-terminated string at p, including the 0
+static long string_size(const byte *p, const byte *end) {
+  const byte *nul = memchr(p, 0, end - p);
+  return (NULL == nul) ? -1 : nul - p + 1;
+}
+
+static long object_size(const byte *p, const byte *end, const int depth);
+
+// Size of n consecutive objects starting at p
+static long objects_size(const byte *p, const byte *end, const long n,
+                         const int depth) {
+  const byte *q = p;
+  long i;
+  for (i = 0; i < n; i++) {
+    const long size = object_size(q, end, depth + 1);
+    if (size < 0) {
+      return -1;
+    }
+    q += size;
+  }
+  return q - p;
+}
+
+static long object_size(const byte *p, const byte *end, const int depth) {
+  if (p >= end || depth > MAX_DEPTH) {
+    return -1;
+  }
+  const int ty = (signed char)p[0];
+  long size;
+
+  if (t_error == ty || t_symbol == ty) {
+    size = string_size(p + 1, end);
+    return (size < 0) ? -1 : 1 + size;
+  }
+  if (ty < 0) {
+    size = elem_size(-ty);
+    return (0 == size || p + 1 + size > end) ? -1 : 1 + size;
+  }
+  if (ty <= -t_time) {
+    // Vectors and mixed lists: type, attribute, count, elements
+    if (p + 6 > end) {
+      return -1;
+    }
+    const long n = read_int32(p + 2);
+    if (n < 0) {
+      return -1;
+    }
+    if (KS == ty) {
+      const byte *q = p + 6;
+      long i;
+      for (i = 0; i < n; i++) {
+        const long len = string_size(q, end);
+        if (len < 0) {
+          return -1;
+        }
+        q += len;
+      }
+      return q - p;
+    }
+    if (t_mixed_list == ty) {
+      size = objects_size(p + 6, end, n, depth);
+      return (size < 0) ? -1 : 6 + size;
+    }
+    size = elem_size(ty);
+    if (0 == size || n > (end - p - 6) / size) {
+      return -1;
+    }
+    return 6 + n * size;
+  }
+
+  switch (ty) {
+  case t_table: {
+    // type, attribute, then a column dictionary: a symbol vector of names
+    // and a general list of as many columns. decode_table relies on this
+    // layout, so anything else is malformed.
+    if (p + 3 > end || (t_dict != p[2] && t_sorted_dict != p[2])) {
+      return -1;
+    }
+    const byte *names = p + 3;
+    const long names_size = object_size(names, end, depth + 1);
+    if (names_size < 0 || KS != names[0]) {
+      return -1;
+    }
+    const byte *cols = names + names_size;
+    size = object_size(cols, end, depth + 1);
+    if (size < 0 || t_mixed_list != cols[0] ||
+        read_int32(cols + 2) != read_int32(names + 2)) {
+      return -1;
+    }
+    return 3 + names_size + size;
+  }
+  case t_dict:
+  case t_sorted_dict: {
+    size = objects_size(p + 1, end, 2, depth);
+    return (size < 0) ? -1 : 1 + size;
+  }
+  case t_lambda: {
+    // context, then the source as a char vector
+    const long ctx = string_size(p + 1, end);
+    if (ctx < 0) {
+      return -1;
+    }
+    size = object_size(p + 1 + ctx, end, depth + 1);
+    return (size < 0) ? -1 : 1 + ctx + size;
+  }
+  case t_unit:
+  case t_operator:
+  case 103: {
+    return (p + 2 > end) ? -1 : 2;
+  }
+  case t_partial_app:
+  case 105: {
+    if (p + 5 > end) {
+      return -1;
+    }
+    const long n = read_int32(p + 1);
+    size = (n < 0) ? -1 : objects_size(p + 5, end, n, depth);
+    return (size < 0) ? -1 : 5 + size;
+  }
+  case 106: case 107: case 108: case 109: case 110: case 111: {
+    // adverbs applied to one object
+    size = object_size(p + 1, end, depth + 1);
+    return (size < 0) ? -1 : 1 + size;
+  }
+  default:
+    return -1;
+  }
+}
+
+long q_object_size(const unsigned char *p, const unsigned char *end) {
+  return object_size(p, end, 0);
+}
+
+
+///////////////////////////////////////////////
+// Decoding of serialised objects
+///////////////////////////////////////////////
+
+static value decode(const byte **pp, const int copy);
+
+// Why objects of type ty are not decoded (as unconvertible in
+// q_interface.c)
+static const char *unsupported(const int ty) {
+  switch (ty) {
+  case t_lambda:      return "Not supported: lambda (type 100)";
+  case t_operator:    return "Not supported: q operator (type 102)";
+  case t_partial_app: return "Not supported: partial application (type 104)";
+  case UU: case -UU:  return "Not supported: guid (type 2)";
+  case KP: case -KP:  return "Not supported: timestamp (type 12)";
+  case KN: case -KN:  return "Not supported: timespan (type 16)";
+  case t_error:       return "Not supported: error (type -128)";
+  default:            return "Not supported: q type";
+  }
+}
+
+// Whether atoms (-ty) and vectors (ty) of type ty are decoded
+static int decodable(const int ty) {
+  switch (ty) {
+  case KB: case KG: case KH: case KI: case KJ: case KE: case KF: case KC:
+  case KS: case KM: case KD: case KZ: case KU: case KV: case KT:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+const char *q_object_unconvertible(const unsigned char *p,
+                                   const unsigned char *end) {
+  const int ty = (signed char)p[0];
+  const char *error;
+
+  switch (ty) {
+  case t_mixed_list: {
+    const long n = read_int32(p + 2);
+    const byte *q = p + 6;
+    long i;
+    for (i = 0; i < n; i++) {
+      if (NULL != (error = q_object_unconvertible(q, end))) {
+        return error;
+      }
+      q += object_size(q, end, 0);
+    }
+    return NULL;
+  }
+  case t_table:
+    // The column dictionary
+    return q_object_unconvertible(p + 2, end);
+  case t_dict:
+  case t_sorted_dict:
+    if (NULL != (error = q_object_unconvertible(p + 1, end))) {
+      return error;
+    }
+    return q_object_unconvertible(p + 1 + object_size(p + 1, end, 0), end);
+  case t_unit:
+    return NULL;
+  default:
+    return decodable(ty < 0 ? -ty : ty) ? NULL : unsupported(ty);
+  }
+}
+
+static int bigarray_kind(const int ty) {
+  switch (ty) {
+  case KB: case KG: case KC:
+    return BIGARRAY_UINT8;
+  case KH:
+    return BIGARRAY_UINT16;
+  case KI: case KM: case KD: case KU: case KV: case KT:
+    return BIGARRAY_INT32;
+  case KJ:
+    return BIGARRAY_INT64;
+  case KE:
+    return BIGARRAY_FLOAT32;
+  case KF: case KZ:
+    return BIGARRAY_FLOAT64;
+  default:
+    caml_failwith(unsupported(ty));
+  }
+}
+
+static value decode_atom(const byte **pp, const int ty) {
+  const byte *p = *pp + 1;
+  int32_t i;
+  int64_t j;
+  float e;
+  double f;
+  short h;
+
+  *pp = p + elem_size(-ty);
+  switch (ty) {
+  case t_bool:
+    return mk_caml_value(tag_bool, Val_bool(p[0]));
+  case t_byte:
+    return mk_caml_value(tag_byte, Val_int(p[0]));
+  case t_char:
+    return mk_caml_value(tag_char, Val_int(p[0]));
+  case t_int16:
+    memcpy(&h, p, sizeof(h));
+    return mk_caml_value(tag_int16, Val_int(h));
+  case t_int32: case t_month: case t_date:
+  case t_minute: case t_second: case t_time:
+    memcpy(&i, p, sizeof(i));
+    return mk_caml_value(tag_for_scalar(ty), caml_copy_int32(i));
+  case t_int64:
+    memcpy(&j, p, sizeof(j));
+    return mk_caml_value(tag_int64, caml_copy_int64(j));
+  case t_float32:
+    memcpy(&e, p, sizeof(e));
+    return mk_caml_value(tag_float32, caml_copy_double(e));
+  case t_float64:
+    memcpy(&f, p, sizeof(f));
+    return mk_caml_value(tag_float64, caml_copy_double(f));
+  case t_datetime:
+    memcpy(&f, p, sizeof(f));
+    return mk_caml_value(tag_datetime, caml_copy_double(f));
+  case t_symbol:
+    *pp = p + strlen((const char *)p) + 1;
+    return mk_caml_value(tag_symbol, caml_copy_string((const char *)p));
+  case t_error:
+    caml_failwith((const char *)p);
+  default:
+    caml_failwith(unsupported(ty));
+  }
+}
+
+static value decode_vector(const byte **pp, const int ty, const int copy) {
+  CAMLparam0 ();
+  CAMLlocal2 (attrib, arr);
+
+  const byte *p = *pp;
+  const long n = read_int32(p + 2);
+  long dims[1];
+  dims[0] = n;
+  attrib = Val_int(p[1]);
+  if (copy) {
+    arr = alloc_bigarray(bigarray_kind(ty) | BIGARRAY_C_LAYOUT, 1, NULL, dims);
+    memcpy(Data_bigarray_val(arr), p + 6, n * elem_size(ty));
+  } else {
+    arr = alloc_bigarray(bigarray_kind(ty) | BIGARRAY_C_LAYOUT, 1, (void *)(p + 6), dims);
+  }
+  *pp = p + 6 + n * elem_size(ty);
+  CAMLreturn (mk_caml_value_two(tag_for_vector(ty), arr, attrib));
+}
+
+static value decode_symbols(const byte **pp) {
+  CAMLparam0 ();
+  CAMLlocal3 (attrib, arr, v);
+
+  const byte *p = *pp;
+  const long n = read_int32(p + 2);
+  attrib = Val_int(p[1]);
+  p += 6;
+  if (0 == n) {
+    arr = Atom(0);
+  } else {
+    arr = caml_alloc(n, 0);
+    long i;
+    for (i = 0; i < n; i++) {
+      v = caml_copy_string((const char *)p);
+      caml_modify(&Field(arr, i), v);
+      p += strlen((const char *)p) + 1;
+    }
+  }
+  *pp = p;
+  CAMLreturn (mk_caml_value_two(tag_v_symbol, arr, attrib));
+}
+
+// A list whose elements are all char vectors, decoded as a Q_v_string
+// (see mk_caml_string_column in q_interface.c)
+static int is_string_column(const byte *p) {
+  const long n = read_int32(p + 2);
+  if (0 == n) {
+    return 0;
+  }
+  p += 6;
+  long i;
+  for (i = 0; i < n; i++) {
+    if (-t_char != (signed char)p[0]) {
+      return 0;
+    }
+    p += 6 + read_int32(p + 2);
+  }
+  return 1;
+}
+
+static value decode_string_column(const byte **pp) {
+  CAMLparam0 ();
+  CAMLlocal3 (attrib, chars, offsets);
+
+  const byte *p = *pp;
+  const long n = read_int32(p + 2);
+  attrib = Val_int(p[1]);
+
+  const byte *q = p + 6;
+  long i, total = 0;
+  for (i = 0; i < n; i++) {
+    const long len = read_int32(q + 2);
+    total += len;
+    q += 6 + len;
+  }
+
+  long dims[1];
+  dims[0] = n + 1;
+  offsets = alloc_bigarray(BIGARRAY_INT64 | BIGARRAY_C_LAYOUT, 1, NULL, dims);
+  dims[0] = total;
+  chars = alloc_bigarray(BIGARRAY_UINT8 | BIGARRAY_C_LAYOUT, 1, NULL, dims);
+
+  int64_t *offs = Data_bigarray_val(offsets);
+  byte *data = Data_bigarray_val(chars);
+  long pos = 0;
+  q = p + 6;
+  for (i = 0; i < n; i++) {
+    const long len = read_int32(q + 2);
+    offs[i] = pos;
+    memcpy(data + pos, q + 6, len);
+    pos += len;
+    q += 6 + len;
+  }
+  offs[n] = pos;
+  *pp = q;
+  CAMLreturn (mk_caml_value_three(tag_v_string, chars, offsets, attrib));
+}
+
+static value decode_mixed_list(const byte **pp, const int copy) {
+  CAMLparam0 ();
+  CAMLlocal2 (v, result);
+
+  const long n = read_int32(*pp + 2);
+  *pp += 6;
+  if (0 == n) {
+    result = Atom(0);
+  } else {
+    result = caml_alloc(n, 0);
+    long i;
+    for (i = 0; i < n; i++) {
+      v = decode(pp, copy);
+      caml_modify(&Field(result, i), v);
+    }
+  }
+  CAMLreturn (mk_caml_value(tag_mixed_list, result));
+}
+
+static value decode_dict(const byte **pp, const int copy) {
+  CAMLparam0 ();
+  CAMLlocal3 (keys, vals, result);
+
+  const int sorted = (t_sorted_dict == **pp);
+  *pp += 1;
+  keys = decode(pp, copy);
+  vals = decode(pp, copy);
+  result = caml_alloc(3, 0);
+  Store_field(result, 0, keys);
+  Store_field(result, 1, vals);
+  Store_field(result, 2, Val_int(sorted ? 1 : 0)); // Attribute (A_s)
+  CAMLreturn (mk_caml_value(tag_dict, result));
+}
+
+static value decode_table(const byte **pp, const int copy) {
+  CAMLparam0 ();
+  CAMLlocal3 (colnames, cols, result);
+
+  const int attrib = (*pp)[1];
+  // The column dictionary
+  *pp += 3;
+  colnames = decode(pp, copy);
+  if (t_mixed_list != (signed char)**pp) {
+    caml_failwith("q_decode_object: malformed table");
+  }
+  // Columns are always a Q_mixed_list (see mk_caml_table)
+  cols = decode_mixed_list(pp, copy);
+  result = caml_alloc(3, 0);
+  Store_field(result, 0, colnames);
+  Store_field(result, 1, cols);
+  Store_field(result, 2, Val_int(attrib)); // Attribute
+  CAMLreturn (mk_caml_value(tag_table, result));
+}
+
+// Convert serialised object->caml, as q_to_caml does for K objects
+static value decode(const byte **pp, const int copy) {
+  const int ty = (signed char)**pp;
+
+  if (ty < 0) {
+    return decode_atom(pp, ty);
+  }
+  switch (ty) {
+  case t_mixed_list:
+    if (is_string_column(*pp)) {
+      return decode_string_column(pp);
+    }
+    return decode_mixed_list(pp, copy);
+  case KS:
+    return decode_symbols(pp);
+  case KB: case KG: case KH: case KI: case KJ: case KE: case KF: case KC:
+  case KM: case KD: case KZ: case KU: case KV: case KT:
+    return decode_vector(pp, ty, copy);
+  case t_table:
+    return decode_table(pp, copy);
+  case t_dict:
+  case t_sorted_dict:
+    return decode_dict(pp, copy);
+  case t_unit:
+    *pp += 2;
+    return Val_int(tag_unit);
+  default:
+    caml_failwith(unsupported(ty));
+  }
+}
+
+value q_decode_object(const unsigned char **p, const int copy) {
+  return decode(p, copy);
+}
+
+
+///////////////////////////////////////////////
+// Encoding of Caml values
+///////////////////////////////////////////////
+
+// Q types of the scalar tags tag_bool .. tag_time. The vector tags
+// tag_v_bool .. tag_v_time are in the same order, with the negated types.
+static const int scalar_types[] = {
+  t_bool, t_byte, t_int16, t_int32, t_int64, t_float32, t_float64, t_char,
+  t_symbol, t_month, t_date, t_datetime, t_minute, t_second, t_time
+};
+
+static long checked_count(const long n) {
+  if (n > INT32_MAX) {
+    caml_failwith("q_serialize: list too long");
+  }
+  return n;
+}
+
+static long encoded_size(const value v) {
+  if (!Is_block(v)) {
+    // Q_unit
+    return 2;
+  }
+  const int tag = Tag_val(v);
+  const value x = Field(v, 0);
+  long size, i;
+
+  if (tag <= tag_time) {
+    if (tag_symbol == tag) {
+      return 1 + caml_string_length(x) + 1;
+    }
+    return 1 + elem_size(-scalar_types[tag]);
+  }
+  switch (tag) {
+  case tag_v_symbol: {
+    const long n = checked_count(Wosize_val(x));
+    size = 6;
+    for (i = 0; i < n; i++) {
+      size += caml_string_length(Field(x, i)) + 1;
+    }
+    return size;
+  }
+  case tag_v_string: {
+    // encode trusts the offsets, so check them here. The strings need not
+    // cover all of the chars.
+    const long n = checked_count(check_string_offsets(v, "q_serialize"));
+    const int64_t *offs = Data_bigarray_val(Field(v, 1));
+    return 6 + 6 * n + (offs[n] - offs[0]);
+  }
+  case tag_mixed_list: {
+    const long n = checked_count(Wosize_val(x));
+    size = 6;
+    for (i = 0; i < n; i++) {
+      size += encoded_size(Field(x, i));
+    }
+    return size;
+  }
+  case tag_table:
+    return 3 + encoded_size(Field(x, 0)) + encoded_size(Field(x, 1));
+  case tag_dict:
+    return 1 + encoded_size(Field(x, 0)) + encoded_size(Field(x, 1));
+  default: {
+    // Vectors of scalars
+    assert(tag_v_bool <= tag && tag <= tag_v_time);
+    const int ty = -scalar_types[tag - tag_v_bool];
+    return 6 + checked_count(Bigarray_val(x)->dim[0]) * elem_size(ty);
+  }
+  }
+}
+
+static byte *encode_header(byte *p, const int ty, const int attrib,
+                           const int32_t n) {
+  p[0] = (byte)ty;
+  p[1] = (byte)attrib;
+  memcpy(p + 2, &n, sizeof(n));
+  return p + 6;
+}
+
+static byte *encode_scalar(byte *p, const int tag, const value x) {
+  const int ty = scalar_types[tag];
+  int32_t i;
+  int64_t j;
+  float e;
+  double f;
+  short h;
+
+  *p++ = (byte)ty;
+  switch (tag) {
+  case tag_bool:
+    *p = Bool_val(x); return p + 1;
+  case tag_byte:
+  case tag_char:
+    *p = Int_val(x); return p + 1;
+  case tag_int16:
+    h = Int_val(x); memcpy(p, &h, sizeof(h)); return p + sizeof(h);
+  case tag_int64:
+    j = Int64_val(x); memcpy(p, &j, sizeof(j)); return p + sizeof(j);
+  case tag_float32:
+    e = Double_val(x); memcpy(p, &e, sizeof(e)); return p + sizeof(e);
+  case tag_float64:
+  case tag_datetime:
+    f = Double_val(x); memcpy(p, &f, sizeof(f)); return p + sizeof(f);
+  case tag_symbol:
+    memcpy(p, String_val(x), caml_string_length(x) + 1);
+    return p + caml_string_length(x) + 1;
+  default:
+    // int32, month, date, minute, second, time
+    i = Int32_val(x); memcpy(p, &i, sizeof(i)); return p + sizeof(i);
+  }
+}
+
+// Write v at p, which has room for encoded_size(v) bytes (and was checked
+// by it). Allocates no caml values, so p may point into a caml string.
+static byte *encode(byte *p, const value v) {
+  if (!Is_block(v)) {
+    p[0] = t_unit;
+    p[1] = 0;
+    return p + 2;
+  }
+  const int tag = Tag_val(v);
+  const value x = Field(v, 0);
+  long i;
+
+  if (tag <= tag_time) {
+    return encode_scalar(p, tag, x);
+  }
+  switch (tag) {
+  case tag_v_symbol: {
+    const long n = Wosize_val(x);
+    p = encode_header(p, KS, Int_val(Field(v, 1)), n);
+    for (i = 0; i < n; i++) {
+      const long len = caml_string_length(Field(x, i)) + 1;
+      memcpy(p, String_val(Field(x, i)), len);
+      p += len;
+    }
+    return p;
+  }
+  case tag_v_string: {
+    const int64_t *offs = Data_bigarray_val(Field(v, 1));
+    const byte *chars = Data_bigarray_val(x);
+    const long n = Bigarray_val(Field(v, 1))->dim[0] - 1;
+    p = encode_header(p, t_mixed_list, Int_val(Field(v, 2)), n);
+    for (i = 0; i < n; i++) {
+      const long len = offs[i + 1] - offs[i];
+      p = encode_header(p, KC, 0, len);
+      memcpy(p, chars + offs[i], len);
+      p += len;
+    }
+    return p;
+  }
+  case tag_mixed_list: {
+    const long n = Wosize_val(x);
+    p = encode_header(p, t_mixed_list, 0, n);
+    for (i = 0; i < n; i++) {
+      p = encode(p, Field(x, i));
+    }
+    return p;
+  }
+  case tag_table: {
+    p[0] = t_table;
+    p[1] = (byte)Int_val(Field(x, 2)); // Attribute
+    p[2] = t_dict;
+    p = encode(p + 3, Field(x, 0));
+    return encode(p, Field(x, 1));
+  }
+  case tag_dict: {
+    // Sorted dictionaries (attribute A_s) have their own type
+    p[0] = (1 == Int_val(Field(x, 2))) ? t_sorted_dict : t_dict;
+    p = encode(p + 1, Field(x, 0));
+    return encode(p, Field(x, 1));
+  }
+  default: {
+    const int ty = -scalar_types[tag - tag_v_bool];
+    const long n = Bigarray_val(x)->dim[0];
+    p = encode_header(p, ty, Int_val(Field(v, 1)), n);
+    memcpy(p, Data_bigarray_val(x), n * elem_size(ty));
+    return p + n * elem_size(ty);
+  }
+  }
+}
+
+// The 8-byte IPC message header, as written by -8!: little endian, async
+// message, not compressed, then the total size
+static byte *encode_message_header(byte *p, const long size) {
+  const int32_t n = size;
+  p[0] = 1;
+  p[1] = 0;
+  p[2] = 0;
+  p[3] = 0;
+  memcpy(p + 4, &n, sizeof(n));
+  return p + 8;
+}
+
+// Size of the whole message holding v
+static long message_size(const value v) {
+  const long size = 8 + encoded_size(v);
+  if (size > INT32_MAX) {
+    caml_failwith("q_serialize: value too large for one message");
+  }
+  return size;
+}
+
+// Check the header of a message of len bytes at p, and the object it
+// holds. Returns the start of the object.
+static const byte *check_message(const byte *p, const long len,
+                                 const char *caller) {
+  char msg[256];
+  int32_t size;
+
+  if (len < 8) {
+    snprintf(msg, sizeof(msg), "%s: not a kdb message", caller);
+    caml_failwith(msg);
+  }
+  memcpy(&size, p + 4, sizeof(size));
+  if (1 != p[0]) {
+    snprintf(msg, sizeof(msg), "%s: big-endian messages are not supported", caller);
+    caml_failwith(msg);
+  }
+  if (0 != p[2]) {
+    snprintf(msg, sizeof(msg), "%s: compressed messages are not supported", caller);
+    caml_failwith(msg);
+  }
+  if (size != len || q_object_size(p + 8, p + len) != len - 8) {
+    snprintf(msg, sizeof(msg), "%s: truncated or malformed message", caller);
+    caml_failwith(msg);
+  }
+  return p + 8;
+}
+
+
+///////////////////////////////////////////////
+// Memory-mapped files
+///////////////////////////////////////////////
+
+static void mapping_finalize(value v) {
+  struct q_mapping *m = Mapping_val(v);
+  if (NULL != m->base) {
+    munmap(m->base, m->len);
+    m->base = NULL;
+  }
+}
+
+static struct custom_operations mapping_ops = {
+  "q_mapping",
+  mapping_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+static void file_fail(const char *caller, const char *path, const char *what) {
+  char msg[512];
+  snprintf(msg, sizeof(msg), "%s: %s: %s", caller, path, what);
+  caml_failwith(msg);
+}
+
+value q_map_file(const char *path, const char *caller) {
+  CAMLparam0 ();
+  CAMLlocal1 (result);
+
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    file_fail(caller, path, strerror(errno));
+  }
+  struct stat st;
+  if (0 != fstat(fd, &st)) {
+    const int err = errno;
+    close(fd);
+    file_fail(caller, path, strerror(err));
+  }
+  if (0 == st.st_size) {
+    close(fd);
+    file_fail(caller, path, "empty file");
+  }
+  byte *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  const int err = errno;
+  close(fd);
+  if (MAP_FAILED == base) {
+    file_fail(caller, path, strerror(err));
+  }
+
+  // The mapping is not counted as caml heap memory
+  result = caml_alloc_custom(&mapping_ops, sizeof(struct q_mapping), 0, 1);
+  Mapping_val(result)->base = base;
+  Mapping_val(result)->len = st.st_size;
+  CAMLreturn (result);
+}
+
+
+///////////////////////////////////////////////
+// Exported Caml functions
+///////////////////////////////////////////////
+
+// The bytes of -8!v
+CAMLprim value q_serialize(value v)
+{
+  CAMLparam1(v);
+  CAMLlocal1(result);
+
+  const long size = message_size(v);
+  result = caml_alloc_string(size);
+  encode(encode_message_header((byte *)String_val(result), size), v);
+  CAMLreturn(result);
+}
+
+// -9!bytes
+CAMLprim value q_deserialize(value bytes)
+{
+  CAMLparam1(bytes);
+  CAMLlocal1(buf);
+
+  // Decoding allocates, and the GC may move the string: decode from a
+  // copy in a bigarray, which stays put and is freed by the GC even if
+  // decoding fails
+  const long len = caml_string_length(bytes);
+  long dims[1];
+  dims[0] = len;
+  buf = alloc_bigarray(BIGARRAY_UINT8 | BIGARRAY_C_LAYOUT, 1, NULL, dims);
+  memcpy(Data_bigarray_val(buf), String_val(bytes), len);
+
+  const byte *p = check_message(Data_bigarray_val(buf), len, "q_deserialize");
+  CAMLreturn(q_decode_object(&p, 1));
+}
+
+// Write the bytes of -8!v to a file, which q can read back with
+// -9!read1`:path. The file is filled in through a shared mapping, without
+// an intermediate buffer.
+// Write the len bytes at buf to fd. Returns 0 or an errno value.
+static int write_all(const int fd, const byte *buf, size_t len) {
+  while (len > 0) {
+    const ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return errno;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// The value is encoded in memory and written to a temporary file in the
+// same directory, which is synced and then renamed over path. Readers, and
+// mappings of the old file, never see a partly written file, and write
+// errors (ENOSPC, EIO) are reported rather than lost.
+CAMLprim value q_write_file(value path, value v)
+{
+  CAMLparam2(path, v);
+
+  const char *name = String_val(path);
+  const long size = message_size(v);
+  byte *buf = malloc(size);
+  char *tmp = malloc(strlen(name) + sizeof(".XXXXXX"));
+  if (NULL == buf || NULL == tmp) {
+    free(buf);
+    free(tmp);
+    caml_raise_out_of_memory();
+  }
+  // encode does not allocate in the caml heap, so name stays valid
+  encode(encode_message_header(buf, size), v);
+
+  sprintf(tmp, "%s.XXXXXX", name);
+  const int fd = mkstemp(tmp);
+  int err = (fd < 0) ? errno : 0;
+  if (0 == err) {
+    err = write_all(fd, buf, size);
+  }
+  if (0 == err && 0 != fchmod(fd, 0644)) {
+    err = errno;
+  }
+  if (0 == err && 0 != fsync(fd)) {
+    err = errno;
+  }
+  if (fd >= 0 && 0 != close(fd) && 0 == err) {
+    err = errno;
+  }
+  if (0 == err && 0 != rename(tmp, name)) {
+    err = errno;
+  }
+  if (0 != err && fd >= 0) {
+    unlink(tmp);
+  }
+  free(buf);
+  free(tmp);
+  if (0 != err) {
+    file_fail("q_write_file", name, strerror(err));
+  }
+  CAMLreturn(Val_unit);
+}
+
+// Map a file written by q_write_file (or by q with
+// `:path 1: -8!v) and check it
+CAMLprim value q_map_value_file(value path)
+{
+  CAMLparam1(path);
+  CAMLlocal1(mapping);
+
+  mapping = q_map_file(String_val(path), "q_map_value_file");
+  check_message(Mapping_val(mapping)->base, Mapping_val(mapping)->len,
+                "q_map_value_file");
+  CAMLreturn(mapping);
+}
+
+// The value in a mapped file. If copy is false its vectors point into the
+// mapping: they are only valid while the mapping is reachable, which is up
+// to the caller (see q_mapped_value_unsafe in q.mli). (Their data is not
+// aligned, as in the message format.)
+CAMLprim value q_mapped_value(value mapping, value copy)
+{
+  CAMLparam2(mapping, copy);
+
+  const byte *p = Mapping_val(mapping)->base + 8;
+  CAMLreturn(q_decode_object(&p, Bool_val(copy)));
+}
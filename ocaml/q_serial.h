@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_serial.h
+ */
+
+#ifndef _Q_SERIAL_H_
+#define	_Q_SERIAL_H_
+
+#include <stddef.h>
+#include <caml/mlvalues.h>
+#include <caml/custom.h>
+
+// Reading and writing of Q values in the kdb serialisation format (the body
+// of an IPC message, after its 8-byte header). Only little-endian data is
+// supported.
+
+// Size in bytes of the object that starts at p, or -1 if it extends past
+// end (a truncated object) or is malformed
+long q_object_size(const unsigned char *p, const unsigned char *end);
+
+// NULL if q_decode_object can decode the object at p (checked with
+// q_object_size against end), otherwise the reason why not
+const char *q_object_unconvertible(const unsigned char *p,
+                                   const unsigned char *end);
+
+// Decode the object at *p, which must have been checked with
+// q_object_size, and advance *p past it. If copy is 0, vectors are
+// bigarrays pointing into the serialised data, which must then outlive
+// them; otherwise their data is copied into caml-managed bigarrays.
+value q_decode_object(const unsigned char **p, const int copy);
+
+// A read-only file mapping, held in a custom block and unmapped when the
+// block is collected
+struct q_mapping {
+  unsigned char *base;
+  size_t len;
+};
+
+#define Mapping_val(v) ((struct q_mapping *) Data_custom_val(v))
+
+// Map the (non-empty) file at path. On errors, fails with a message that
+// starts with caller.
+value q_map_file(const char *path, const char *caller);
+
+#endif /* _Q_SERIAL_H_ */
@@ -0,0 +1,151 @@
+(*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_test_arrow.ml
+ *
+ * Checks of the export to the Arrow C Data Interface. The exported structs
+ * are read back with the accessors in q_test_stubs.c.
+ *
+ * Usage: q_test_arrow
+ *)
+
+open Bigarray
+open Q
+open Q_check
+
+(* Accessors for the Arrow structs (q_test_stubs.c) *)
+external schema_format : nativeint -> string = "q_test_schema_format"
+external schema_name : nativeint -> string = "q_test_schema_name"
+external schema_flags : nativeint -> int = "q_test_schema_flags"
+external schema_n_children : nativeint -> int = "q_test_schema_n_children"
+external schema_child : nativeint -> int -> nativeint = "q_test_schema_child"
+external schema_dictionary : nativeint -> nativeint = "q_test_schema_dictionary"
+external array_length : nativeint -> int = "q_test_array_length"
+external array_null_count : nativeint -> int = "q_test_array_null_count"
+external array_child : nativeint -> int -> nativeint = "q_test_array_child"
+external array_dictionary : nativeint -> nativeint = "q_test_array_dictionary"
+external array_valid : nativeint -> int -> bool = "q_test_array_valid"
+external array_bit : nativeint -> int -> bool = "q_test_array_bit"
+external array_int32 : nativeint -> int -> int -> int32 = "q_test_array_int32"
+external array_int64 : nativeint -> int -> int -> int64 = "q_test_array_int64"
+external array_float64 : nativeint -> int -> int -> float = "q_test_array_float64"
+external array_chars : nativeint -> int -> int -> int -> string = "q_test_array_chars"
+
+
+let test_arrow () =
+  let (arr, sch) = q_arrow_alloc () in
+  (* The table is unreachable once exported: the export must keep the
+     buffers it points into alive *)
+  let export () =
+    q_arrow_export
+      (Q_table { colnames = Q_v_symbol ([| "sym"; "px"; "qty"; "d"; "flag"; "note" |], A_none);
+                 cols = Q_mixed_list
+                   [| Q_v_symbol ([| "a"; ""; "b"; "a" |], A_none);
+                      Q_v_float64 (ba float64 [1.0; nan; 3.0; 4.0], A_none);
+                      Q_v_int64 (ba int64 [1L; Int64.min_int; 3L; 4L], A_none);
+                      Q_v_date (ba int32 [0l; Int32.min_int; 1l; 2l], A_none);
+                      Q_v_bool (ba int8_unsigned [1; 0; 1; 1], A_none);
+                      strings ["w"; "x"; ""; "yz"] |];
+                 attrib_t = A_none })
+      arr sch in
+  export ();
+  Gc.full_major ();
+  Gc.compact ();
+  let nullable = 2 in
+  check "table is a struct array"
+    (schema_format sch = "+s" && schema_n_children sch = 6 && array_length arr = 4);
+  check "column names"
+    (List.map (fun i -> schema_name (schema_child sch i)) [0; 1; 2; 3; 4; 5]
+     = ["sym"; "px"; "qty"; "d"; "flag"; "note"]);
+  check "column formats"
+    (List.map (fun i -> schema_format (schema_child sch i)) [0; 1; 2; 3; 4; 5]
+     = ["i"; "g"; "l"; "tdD"; "b"; "U"]);
+
+  let sym = array_child arr 0 and sym_sch = schema_child sch 0 in
+  let dict = array_dictionary sym in
+  check "symbols: dictionary indices"
+    (List.map (fun i -> array_int32 sym 1 i) [0; 1; 2; 3] = [0l; 1l; 2l; 0l]);
+  check "symbols: dictionary"
+    (schema_format (schema_dictionary sym_sch) = "U" && array_length dict = 3 &&
+     array_chars dict 2 0 2 = "ab" &&
+     List.map (fun i -> array_int64 dict 1 i) [0; 1; 2; 3] = [0L; 1L; 1L; 2L]);
+  check "symbols: null symbol"
+    (array_null_count sym = 1 && not (array_valid sym 1) && array_valid sym 0 &&
+     schema_flags sym_sch land nullable <> 0);
+
+  let px = array_child arr 1 in
+  check "floats: values and null"
+    (array_float64 px 1 0 = 1.0 && array_float64 px 1 3 = 4.0 &&
+     array_null_count px = 1 && not (array_valid px 1) && array_valid px 2);
+
+  let qty = array_child arr 2 in
+  check "longs: values and null"
+    (array_int64 qty 1 2 = 3L && array_null_count qty = 1 && not (array_valid qty 1));
+
+  let d = array_child arr 3 in
+  check "dates: days since 1970 and null"
+    (array_int32 d 1 0 = 10957l && array_int32 d 1 2 = 10958l &&
+     array_null_count d = 1 && not (array_valid d 1) && array_valid d 3);
+
+  let flag = array_child arr 4 in
+  check "bools: bit packed, no nulls"
+    (List.map (array_bit flag) [0; 1; 2; 3] = [true; false; true; true] &&
+     array_null_count flag = 0 && array_valid flag 1 &&
+     schema_flags (schema_child sch 4) land nullable = 0);
+
+  let note = array_child arr 5 in
+  check "strings: offsets and chars"
+    (List.map (fun i -> array_int64 note 1 i) [0; 1; 2; 3; 4] = [0L; 1L; 2L; 2L; 4L] &&
+     array_chars note 2 2 4 = "yz" && array_null_count note = 0);
+
+  q_arrow_free (arr, sch);
+  let structs = q_arrow_alloc () in
+  check "exporting an atom fails"
+    (raises_failure (fun () -> q_arrow_export (Q_int32 1l) (fst structs) (snd structs)));
+  q_arrow_free structs
+
+
+(* Symbols and strings that are not UTF-8 are exported as binary *)
+let test_encoding () =
+  let format v =
+    let (arr, sch) as structs = q_arrow_alloc () in
+    q_arrow_export v arr sch;
+    let f = schema_format sch
+    and d = schema_dictionary sch in
+    let dict = if d = 0n then "" else schema_format d in
+    q_arrow_free structs;
+    (f, dict) in
+  check "utf8 strings" (format (strings ["caf\195\169"; ""]) = ("U", ""));
+  check "binary strings" (format (strings ["ok"; "\255\000"]) = ("Z", ""));
+  check "string split inside a utf8 sequence"
+    (format (strings ["\195"; "\169"]) = ("Z", ""));
+  check "utf8 symbols" (format (Q_v_symbol ([| "\226\130\172" |], A_none)) = ("i", "U"));
+  check "binary symbols" (format (Q_v_symbol ([| "a"; "\192\175" |], A_none)) = ("i", "Z"))
+
+
+(* Malformed Q_v_string offsets are rejected, alone or as a column *)
+let test_bad_offsets () =
+  List.iter
+    (fun offsets ->
+      let bad = Q_v_string (chars "abc", ba int64 offsets, A_none) in
+      let table =
+        Q_table { colnames = Q_v_symbol ([| "s" |], A_none);
+                  cols = Q_mixed_list [| bad |];
+                  attrib_t = A_none } in
+      List.iter
+        (fun v ->
+          let (arr, sch) as structs = q_arrow_alloc () in
+          check "export of malformed string offsets fails"
+            (raises_failure (fun () -> q_arrow_export v arr sch));
+          q_arrow_free structs)
+        [ bad; table ])
+    [ []; [0L; 5L]; [1L; 2L]; [0L; 2L; 1L] ]
+
+
+
+
+let () =
+  test_arrow ();
+  test_encoding ();
+  test_bad_offsets ();
+  finish ()
@@ -0,0 +1,117 @@
+(*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_test_journal.ml
+ *
+ * Checks of tickerplant journal replay, on journals written by the test.
+ *
+ * Usage: q_test_journal
+ *)
+
+open Bigarray
+open Q
+open Q_check
+
+(* A logged message: the serialised object without the message header *)
+let body v =
+  let s = q_serialize v in
+  String.sub s 8 (String.length s - 8)
+
+let upd table data = Q_mixed_list [| Q_symbol "upd"; Q_symbol table; data |]
+
+let journal_header = "\255\001\000\000\003\000\000\000"
+
+
+(* A tickerplant log with two messages and the start of a third *)
+let test_journal () =
+  let quotes = Q_mixed_list [| Q_v_symbol ([| "a" |], A_none);
+                               Q_v_float64 (ba float64 [1.25], A_none) |] in
+  let last = body (upd "trade" trades) in
+  let path = Filename.temp_file "q_test" ".tpl" in
+  write_file path
+    (String.concat ""
+       [ journal_header;
+         body (upd "trade" trades);
+         body (upd "quote" quotes);
+         String.sub last 0 (String.length last - 5) ]);
+  let journal = q_journal_open path in
+  check "journal with a truncated tail" (q_journal_validate journal = (2, true));
+  let replayed = ref [] in
+  let f table data = replayed := (table, data) :: !replayed in
+  let calls = q_journal_replay journal f in
+  check "replay of all messages"
+    (calls = 2 && List.rev !replayed = [ ("trade", trades); ("quote", quotes) ]);
+  replayed := [];
+  let calls = q_journal_replay ~tables:["quote"] journal f in
+  check "replay of one table" (calls = 1 && !replayed = [ ("quote", quotes) ]);
+  replayed := [];
+  let calls = q_journal_replay ~first:1 journal f in
+  check "replay from a message" (calls = 1 && !replayed = [ ("quote", quotes) ]);
+  replayed := [];
+  let calls = q_journal_replay ~last:1 journal f in
+  check "replay up to a message" (calls = 1 && !replayed = [ ("trade", trades) ]);
+  Sys.remove path
+
+
+(* Tables whose column dictionary is not a symbol vector and a general list
+   of as many columns end the valid part of a journal *)
+let test_malformed_table () =
+  let upd_trade data = "\000\000\003\000\000\000\245upd\000\245trade\000" ^ data in
+  let longs = "\007\000\002\000\000\000" ^ String.make 16 '\001' in
+  let syms = "\011\000\001\000\000\000a\000" in
+  List.iter
+    (fun (name, data) ->
+      let path = Filename.temp_file "q_test" ".tpl" in
+      write_file path
+        (String.concat "" [ journal_header; body (upd "trade" trades); upd_trade data ]);
+      let journal = q_journal_open path in
+      check ("journal with " ^ name) (q_journal_validate journal = (1, true));
+      check ("replay stops before " ^ name)
+        (q_journal_replay journal (fun _ _ -> ()) = 1);
+      Sys.remove path)
+    [ "a table of a vector", "\098\000" ^ longs;
+      "a table of a non-symbol dictionary", "\098\000\099" ^ longs ^ "\000\000\001\000\000\000" ^ longs;
+      "a table of a vector of columns", "\098\000\099" ^ syms ^ longs;
+      "a table with too few columns", "\098\000\099" ^ syms ^ "\000\000\000\000\000\000" ]
+
+
+(* Messages that cannot be decoded are reported, and replay goes on *)
+let test_unconvertible () =
+  (* A timestamp vector and a lambda *)
+  let timestamps = "\012\000\001\000\000\000" ^ String.make 8 '\000' in
+  let lambda = "\100\000\010\000\003\000\000\000{x}" in
+  let upd_trade data = "\000\000\003\000\000\000\245upd\000\245trade\000" ^ data in
+  let path = Filename.temp_file "q_test" ".tpl" in
+  write_file path
+    (String.concat ""
+       [ journal_header;
+         upd_trade timestamps;
+         body (upd "trade" trades);
+         upd_trade ("\000\000\002\000\000\000" ^ lambda ^ timestamps) ]);
+  let journal = q_journal_open path in
+  check "journal with unconvertible messages" (q_journal_validate journal = (3, false));
+  let errors = ref [] and replayed = ref [] in
+  let on_error i reason = errors := (i, reason) :: !errors in
+  let calls =
+    q_journal_replay ~on_error journal (fun table data -> replayed := (table, data) :: !replayed) in
+  check "replay past unconvertible messages" (calls = 1 && !replayed = [ ("trade", trades) ]);
+  check "unconvertible messages reported"
+    (List.rev !errors = [ (0, "Not supported: timestamp (type 12)");
+                          (2, "Not supported: lambda (type 100)") ]);
+  Sys.remove path
+
+
+let test_not_a_journal () =
+  let path = Filename.temp_file "q_test" ".dat" in
+  q_write_file path trades;
+  check "q_journal_open of a value file fails"
+    (raises_failure (fun () -> q_journal_open path));
+  Sys.remove path
+
+
+let () =
+  test_journal ();
+  test_malformed_table ();
+  test_unconvertible ();
+  test_not_a_journal ();
+  finish ()
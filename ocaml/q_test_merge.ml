@@ -0,0 +1,85 @@
+(*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_test_merge.ml
+ *
+ * Checks of the merge of tables used by q_fanout_merge, through
+ * q_merge_tables.
+ *
+ * Usage: q_test_merge
+ *)
+
+open Bigarray
+open Q
+open Q_check
+
+let table time sym px =
+  Q_table { colnames = Q_v_symbol ([| "time"; "sym"; "px" |], A_none);
+            cols = Q_mixed_list [| Q_v_int64 (ba int64 time, A_none);
+                                   Q_v_symbol (Array.of_list sym, A_none);
+                                   Q_v_float64 (ba float64 px, A_none) |];
+            attrib_t = A_none }
+
+let a = table [1L; 4L; 6L] ["a"; "a"; "a"] [1.0; 4.0; 6.0]
+let b = table [2L; 4L] ["b"; "b"] [2.0; 4.5]
+let c = table [0L; 7L] ["c"; "c"] [0.5; 7.0]
+let empty = table [] [] []
+
+
+let test_concat () =
+  check "concatenation in order"
+    (q_merge_tables [| a; b |]
+     = table [1L; 4L; 6L; 2L; 4L] ["a"; "a"; "a"; "b"; "b"] [1.0; 4.0; 6.0; 2.0; 4.5]);
+  check "one table" (q_merge_tables [| a |] = a);
+  check "with an empty table" (q_merge_tables [| empty; b |] = b);
+  check "no tables" (q_merge_tables [||] = Q_unit);
+  check "string column"
+    (q_merge_tables [| trades; trades |]
+     = Q_table { colnames = Q_v_symbol ([| "sym"; "px"; "qty"; "note" |], A_none);
+                 cols = Q_mixed_list [| Q_v_symbol ([| "a"; "b"; "a"; "b" |], A_none);
+                                        Q_v_float64 (ba float64 [1.5; 2.5; 1.5; 2.5], A_none);
+                                        Q_v_int64 (ba int64 [10L; 20L; 10L; 20L], A_none);
+                                        strings ["x"; "yz"; "x"; "yz"] |];
+                 attrib_t = A_none })
+
+
+let test_sorted () =
+  check "merge on a column"
+    (q_merge_tables ~sort_col:"time" [| a; b; c |]
+     = table [0L; 1L; 2L; 4L; 4L; 6L; 7L] ["c"; "a"; "b"; "a"; "b"; "a"; "c"]
+         [0.5; 1.0; 2.0; 4.0; 4.5; 6.0; 7.0]);
+  check "ties keep table order"
+    (q_merge_tables ~sort_col:"time" [| b; a |]
+     = table [1L; 2L; 4L; 4L; 6L] ["a"; "b"; "b"; "a"; "a"] [1.0; 2.0; 4.5; 4.0; 6.0]);
+  check "merge on a float column"
+    (q_merge_tables ~sort_col:"px" [| c; empty; a |]
+     = table [0L; 1L; 4L; 6L; 7L] ["c"; "a"; "a"; "a"; "c"] [0.5; 1.0; 4.0; 6.0; 7.0]);
+  check "merge on a symbol column"
+    (q_merge_tables ~sort_col:"sym" [| c; b; a |]
+     = table [1L; 4L; 6L; 2L; 4L; 0L; 7L] ["a"; "a"; "a"; "b"; "b"; "c"; "c"]
+         [1.0; 4.0; 6.0; 2.0; 4.5; 0.5; 7.0]);
+  check "merge on a string column fails"
+    (raises_failure (fun () -> q_merge_tables ~sort_col:"note" [| trades; trades |]));
+  check "merge on a missing column fails"
+    (raises_failure (fun () -> q_merge_tables ~sort_col:"size" [| a; b |]))
+
+
+let test_mismatch () =
+  let other = Q_table { colnames = Q_v_symbol ([| "time" |], A_none);
+                        cols = Q_mixed_list [| Q_v_int64 (ba int64 [1L], A_none) |];
+                        attrib_t = A_none } in
+  check "schema mismatch fails" (raises_failure (fun () -> q_merge_tables [| a; other |]));
+  let float_time = Q_table { colnames = Q_v_symbol ([| "time"; "sym"; "px" |], A_none);
+                             cols = Q_mixed_list [| Q_v_float64 (ba float64 [1.0], A_none);
+                                                    Q_v_symbol ([| "x" |], A_none);
+                                                    Q_v_float64 (ba float64 [1.0], A_none) |];
+                             attrib_t = A_none } in
+  check "column type mismatch fails" (raises_failure (fun () -> q_merge_tables [| a; float_time |]));
+  check "not a table fails" (raises_failure (fun () -> q_merge_tables [| a; Q_int64 1L |]))
+
+
+let () =
+  test_concat ();
+  test_sorted ();
+  test_mismatch ();
+  finish ()
@@ -0,0 +1,108 @@
+(*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_test_serial.ml
+ *
+ * Checks of serialisation (q_serialize, q_deserialize) and of value
+ * files.
+ *
+ * Usage: q_test_serial
+ *)
+
+open Bigarray
+open Q
+open Q_check
+
+let sorted_dict =
+  Q_dict { keys = Q_v_symbol ([| "a"; "b" |], A_s);
+           vals = Q_v_int32 (ba int32 [1l; 2l], A_none);
+           attrib_d = A_s }
+
+let values = [
+  "bool", Q_bool true;
+  "byte", Q_byte 255;
+  "short", Q_short 300;
+  "int", Q_int32 (-42l);
+  "long", Q_int64 1234567890123L;
+  "real", Q_float32 1.5;
+  "float", Q_float64 (-2.25);
+  "char", Q_char 'q';
+  "symbol", Q_symbol "trade";
+  "month", Q_month 5l;
+  "date", Q_date 100l;
+  "datetime", Q_datetime 1.5;
+  "minute", Q_minute 61l;
+  "second", Q_second 3601l;
+  "time", Q_time 1000l;
+  "bool vector", Q_v_bool (ba int8_unsigned [1; 0; 1], A_none);
+  "byte vector", Q_v_byte (ba int8_unsigned [0; 127; 255], A_none);
+  "short vector", Q_v_short (ba int16_unsigned [1; 2; 65535], A_none);
+  "int vector", Q_v_int32 (ba int32 [1l; Int32.min_int], A_s);
+  "long vector", Q_v_int64 (ba int64 [1L; Int64.min_int], A_none);
+  "real vector", Q_v_float32 (ba float32 [0.5; 1.5], A_none);
+  "float vector", Q_v_float64 (ba float64 [0.25; 1e10], A_p);
+  "char vector", Q_v_char (chars "hello", A_none);
+  "symbol vector", Q_v_symbol ([| "a"; ""; "c" |], A_u);
+  "month vector", Q_v_month (ba int32 [1l; 2l], A_none);
+  "date vector", Q_v_date (ba int32 [1l; Int32.min_int], A_none);
+  "datetime vector", Q_v_datetime (ba float64 [0.5; 1.5], A_none);
+  "minute vector", Q_v_minute (ba int32 [1l; 2l], A_none);
+  "second vector", Q_v_second (ba int32 [1l; 2l], A_none);
+  "time vector", Q_v_time (ba int32 [1l; 2l], A_g);
+  "string list", strings ["ab"; ""; "cde"];
+  "mixed list", Q_mixed_list [| Q_int64 1L; Q_symbol "x"; Q_v_char (chars "str", A_none) |];
+  "empty list", Q_mixed_list [||];
+  "table", trades;
+  "dict", Q_dict { keys = Q_v_symbol ([| "x"; "y" |], A_none);
+                   vals = Q_mixed_list [| Q_int64 1L; Q_symbol "z" |];
+                   attrib_d = A_none };
+  "sorted dict", sorted_dict;
+  "unit", Q_unit;
+]
+
+
+let test_serial () =
+  List.iter
+    (fun (name, v) ->
+      check ("round trip " ^ name) (q_deserialize (q_serialize v) = v))
+    values;
+  (* -8!42i in q *)
+  check "bytes of 42i"
+    (q_serialize (Q_int32 42l) = "\001\000\000\000\013\000\000\000\250\042\000\000\000");
+  (* Offsets need not cover all the chars *)
+  let part = Q_v_string (chars "helloworld", ba int64 [0L; 2L; 5L], A_none) in
+  check "string list over part of its chars"
+    (string_list (q_deserialize (q_serialize part)) = ["he"; "llo"]);
+  List.iter
+    (fun offsets ->
+      let bad = Q_v_string (chars "abc", ba int64 offsets, A_none) in
+      check "malformed string offsets fail" (raises_failure (fun () -> q_serialize bad)))
+    [ [0L; 5L]; [1L; 2L]; [0L; 2L; 1L]; [] ];
+  check "truncated message fails"
+    (raises_failure (fun () ->
+      let s = q_serialize trades in
+      q_deserialize (String.sub s 0 (String.length s - 1))))
+
+
+let test_files () =
+  let path = Filename.temp_file "q_test" ".dat" in
+  q_write_file path trades;
+  check "file holds the serialised bytes" (read_file path = q_serialize trades);
+  check "q_read_file" (q_read_file path = trades);
+  let mapped = q_map_value_file path in
+  check "q_mapped_value" (q_mapped_value mapped = trades);
+  check "q_mapped_value_unsafe" (q_mapped_value_unsafe mapped = trades);
+  (* The file is replaced, not rewritten in place, so the mapping keeps
+     the old bytes *)
+  q_write_file path (Q_int64 1L);
+  check "q_mapped_value after an overwrite" (q_mapped_value mapped = trades);
+  check "overwritten file" (q_read_file path = Q_int64 1L);
+  Sys.remove path;
+  check "q_write_file into a missing directory fails"
+    (raises_failure (fun () -> q_write_file (Filename.concat path "x") trades))
+
+
+let () =
+  test_serial ();
+  test_files ();
+  finish ()
@@ -0,0 +1,52 @@
+(*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_test_strings.ml
+ *
+ * Checks of the decoding of string columns (lists of char vectors) into
+ * Q_v_string by q_to_caml, on K values built with q_view_of_val.
+ *
+ * Usage: q_test_strings
+ *)
+
+open Bigarray
+open Q
+open Q_check
+
+(* v converted to K and back with q_to_caml *)
+let via_k v = q_view_value (q_view_of_val v)
+
+let offsets v =
+  match v with
+  | Q_v_string (_, o, _) -> Array.to_list (Array.init (Array1.dim o) (fun i -> o.{i}))
+  | _ -> []
+
+let char_vectors l = Q_mixed_list (Array.of_list (List.map (fun s -> Q_v_char (chars s, A_none)) l))
+
+
+let test_string_columns () =
+  let v = via_k (char_vectors ["ab"; ""; "cde"]) in
+  check "list of char vectors is a Q_v_string"
+    (string_list v = ["ab"; ""; "cde"] && offsets v = [0L; 2L; 2L; 5L]);
+  let empty = via_k (char_vectors [""]) in
+  check "one empty string" (string_list empty = [""] && offsets empty = [0L; 0L]);
+  check "Q_v_string round trip" (via_k (strings ["x"; "yz"]) = strings ["x"; "yz"]);
+  let note = q_view_value (q_view_column (q_view_of_val trades) "note") in
+  check "string column of a table" (string_list note = ["x"; "yz"]);
+  check "table with a string column" (via_k trades = trades)
+
+
+let test_other_lists () =
+  List.iter
+    (fun (name, v) -> check (name ^ " stays a Q_mixed_list") (via_k v = v))
+    [ "empty list", Q_mixed_list [||];
+      "list of char atoms", Q_mixed_list [| Q_char 'a'; Q_char 'b' |];
+      "char vector and long", Q_mixed_list [| Q_v_char (chars "ab", A_none); Q_int64 1L |];
+      "char and byte vectors",
+      Q_mixed_list [| Q_v_char (chars "ab", A_none); Q_v_byte (ba int8_unsigned [1], A_none) |] ]
+
+
+let () =
+  test_string_columns ();
+  test_other_lists ();
+  finish ()
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_test_stubs.c
+ */
+
+// Accessors for the Arrow structs filled in by q_arrow_export, so that
+// q_test_arrow can check them from caml. Addresses are passed as
+// nativeints, as returned by q_arrow_alloc. Not part of the library.
+
+#include <stdint.h>
+#include <string.h>
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include "q_arrow.h"
+
+#define Array_addr(v)  ((struct ArrowArray *)Nativeint_val(v))
+#define Schema_addr(v) ((struct ArrowSchema *)Nativeint_val(v))
+
+CAMLprim value q_test_schema_format(value sch)
+{
+  CAMLparam1(sch);
+  CAMLreturn(caml_copy_string(Schema_addr(sch)->format));
+}
+
+CAMLprim value q_test_schema_name(value sch)
+{
+  CAMLparam1(sch);
+  CAMLreturn(caml_copy_string(Schema_addr(sch)->name));
+}
+
+CAMLprim value q_test_schema_flags(value sch)
+{
+  CAMLparam1(sch);
+  CAMLreturn(Val_long(Schema_addr(sch)->flags));
+}
+
+CAMLprim value q_test_schema_n_children(value sch)
+{
+  CAMLparam1(sch);
+  CAMLreturn(Val_long(Schema_addr(sch)->n_children));
+}
+
+CAMLprim value q_test_schema_child(value sch, value i)
+{
+  CAMLparam2(sch, i);
+  CAMLreturn(caml_copy_nativeint((intnat)Schema_addr(sch)->children[Long_val(i)]));
+}
+
+CAMLprim value q_test_schema_dictionary(value sch)
+{
+  CAMLparam1(sch);
+  CAMLreturn(caml_copy_nativeint((intnat)Schema_addr(sch)->dictionary));
+}
+
+CAMLprim value q_test_array_length(value arr)
+{
+  CAMLparam1(arr);
+  CAMLreturn(Val_long(Array_addr(arr)->length));
+}
+
+CAMLprim value q_test_array_null_count(value arr)
+{
+  CAMLparam1(arr);
+  CAMLreturn(Val_long(Array_addr(arr)->null_count));
+}
+
+CAMLprim value q_test_array_child(value arr, value i)
+{
+  CAMLparam2(arr, i);
+  CAMLreturn(caml_copy_nativeint((intnat)Array_addr(arr)->children[Long_val(i)]));
+}
+
+CAMLprim value q_test_array_dictionary(value arr)
+{
+  CAMLparam1(arr);
+  CAMLreturn(caml_copy_nativeint((intnat)Array_addr(arr)->dictionary));
+}
+
+// Whether element i is valid (true if the array has no validity bitmap)
+CAMLprim value q_test_array_valid(value arr, value i)
+{
+  CAMLparam2(arr, i);
+  const uint8_t *bits = Array_addr(arr)->buffers[0];
+  const long j = Long_val(i);
+  CAMLreturn(Val_bool(NULL == bits || (bits[j / 8] >> (j % 8)) & 1));
+}
+
+// Bit i of buffer 1 (boolean arrays)
+CAMLprim value q_test_array_bit(value arr, value i)
+{
+  CAMLparam2(arr, i);
+  const uint8_t *bits = Array_addr(arr)->buffers[1];
+  const long j = Long_val(i);
+  CAMLreturn(Val_bool((bits[j / 8] >> (j % 8)) & 1));
+}
+
+// Element i of buffer b, read as an int32, an int64 or a double
+CAMLprim value q_test_array_int32(value arr, value b, value i)
+{
+  CAMLparam3(arr, b, i);
+  const int32_t *data = Array_addr(arr)->buffers[Long_val(b)];
+  CAMLreturn(caml_copy_int32(data[Long_val(i)]));
+}
+
+CAMLprim value q_test_array_int64(value arr, value b, value i)
+{
+  CAMLparam3(arr, b, i);
+  const int64_t *data = Array_addr(arr)->buffers[Long_val(b)];
+  CAMLreturn(caml_copy_int64(data[Long_val(i)]));
+}
+
+CAMLprim value q_test_array_float64(value arr, value b, value i)
+{
+  CAMLparam3(arr, b, i);
+  const double *data = Array_addr(arr)->buffers[Long_val(b)];
+  CAMLreturn(caml_copy_double(data[Long_val(i)]));
+}
+
+// Bytes [from, to) of buffer b, as a string (utf8 data)
+CAMLprim value q_test_array_chars(value arr, value b, value from, value to)
+{
+  CAMLparam4(arr, b, from, to);
+  CAMLlocal1(result);
+  const char *data = Array_addr(arr)->buffers[Long_val(b)];
+  const long len = Long_val(to) - Long_val(from);
+  result = caml_alloc_string(len);
+  memcpy((char *)String_val(result), data + Long_val(from), len);
+  CAMLreturn(result);
+}
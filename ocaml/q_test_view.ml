@@ -0,0 +1,81 @@
+(*
+ * Copyright (c) 2007 Fermin Reig (fermin@xrnd.com)
+ *
+ * q_test_view.ml
+ *
+ * Checks of lazy views, over values converted with q_view_of_val.
+ *
+ * Usage: q_test_view
+ *)
+
+open Bigarray
+open Q
+open Q_check
+
+let raises_not_found f =
+  try ignore (f ()); false with Not_found -> true
+
+let prices =
+  Q_dict { keys = Q_v_symbol ([| "a"; "b" |], A_none);
+           vals = Q_v_float64 (ba float64 [1.5; 2.5], A_none);
+           attrib_d = A_none }
+
+(* A table keyed on sym *)
+let keyed =
+  Q_dict { keys = Q_table { colnames = Q_v_symbol ([| "sym" |], A_none);
+                            cols = Q_mixed_list [| Q_v_symbol ([| "a"; "b" |], A_none) |];
+                            attrib_t = A_none };
+           vals = Q_table { colnames = Q_v_symbol ([| "px" |], A_none);
+                            cols = Q_mixed_list [| Q_v_float64 (ba float64 [1.5; 2.5], A_none) |];
+                            attrib_t = A_none };
+           attrib_d = A_none }
+
+
+let test_table () =
+  let view = q_view_of_val trades in
+  check "table: type and rows" (q_view_type view = 98 && q_view_count view = 2);
+  let px = q_view_column view "px" in
+  check "table: float column" (q_view_type px = 9 && q_view_count px = 2);
+  check "table: element of a column" (q_view_value (q_view_index px 1) = Q_float64 2.5);
+  check "table: symbol element" (q_view_value (q_view_index (q_view_column view "sym") 0) = Q_symbol "a");
+  let note = q_view_column view "note" in
+  check "table: string column is a list of char vectors"
+    (q_view_type note = 0 && q_view_type (q_view_index note 1) = 10 &&
+     q_view_count (q_view_index note 1) = 2);
+  check "table: missing column" (raises_not_found (fun () -> q_view_column view "size"));
+  check "table: children are cached" (q_view_column view "px" == px);
+  check "table: whole value" (q_view_value view = trades);
+  check "table: values are cached" (q_view_value view == q_view_value view)
+
+
+let test_dict () =
+  let view = q_view_of_val prices in
+  check "dict: type and count" (q_view_type view = 99 && q_view_count view = 2);
+  check "dict: find" (q_view_value (q_view_find view "b") = Q_float64 2.5);
+  check "dict: missing key" (raises_not_found (fun () -> q_view_find view "c"));
+  check "dict: keys" (q_view_value (q_view_keys view) = Q_v_symbol ([| "a"; "b" |], A_none));
+  check "dict: values" (q_view_type (q_view_values view) = 9);
+  check "dict: no columns" (raises_failure (fun () -> q_view_column view "a"))
+
+
+let test_keyed () =
+  let view = q_view_of_val keyed in
+  check "keyed table: key column"
+    (q_view_value (q_view_column view "sym") = Q_v_symbol ([| "a"; "b" |], A_none));
+  check "keyed table: value column" (q_view_value (q_view_index (q_view_column view "px") 0) = Q_float64 1.5);
+  check "keyed table: keys are a table" (q_view_type (q_view_keys view) = 98)
+
+
+let test_atom () =
+  let view = q_view_of_val (Q_int64 7L) in
+  check "atom: type and count" (q_view_type view = -7 && q_view_count view = 1);
+  check "atom: value" (q_view_value view = Q_int64 7L);
+  check "atom: no elements" (raises_failure (fun () -> q_view_index view 0))
+
+
+let () =
+  test_table ();
+  test_dict ();
+  test_keyed ();
+  test_atom ();
+  finish ()